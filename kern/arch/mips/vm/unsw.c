@@ -59,7 +59,7 @@ static uint32_t last_frame;
  * uniprocessor) as this implementation does not block.
  */ 
 
-static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock frame_table_spinlock = SPINLOCK_TICKET_INITIALIZER;
 
 /*
  * Called very early in system boot to figure out how much physical
@@ -142,6 +142,8 @@ ram_bootstrap(void)
                 frame_table[i].allocated = FALSE;
         }
 
+        spinlock_track(&frame_table_spinlock, "frame_table");
+
         
 }
 
@@ -267,6 +267,27 @@ mainbus_ramsize(void)
 	return ramsize;
 }
 
+/*
+ * Stop and restart hardclock on the current CPU.
+ *
+ * There is no way to disable the on-chip timer as such; instead push
+ * the compare value as far out as it goes, which at 25 MHz is nearly
+ * three minutes. If the timer does go off while we're still idle,
+ * hardclock finds nothing to do and mainbus_interrupt pushes it out
+ * again.
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_set(0xffffffff);
+}
+
+void
+mainbus_hardclock_start(void)
+{
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
 /*
  * Send IPI.
  */
@@ -314,8 +335,16 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		/*
+		 * Reset the timer (this clears the interrupt). If the
+		 * cpu is idle, the tick is stopped; keep it that way.
+		 */
+		if (curcpu->c_isidle) {
+			mainbus_hardclock_stop();
+		}
+		else {
+			mainbus_hardclock_start();
+		}
 		/* and call hardclock */
 		hardclock();
 		seen = true;
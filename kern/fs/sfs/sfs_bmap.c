@@ -35,156 +35,223 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Block mapping layout. File blocks 0 through SFS_NDIRECT-1 are
+ * mapped directly from the inode; the next SFS_DBPERIDB through the
+ * indirect block; and the next SFS_DBPERIDB*SFS_DBPERIDB through the
+ * double indirect block, which points to second-level indirect
+ * blocks.
+ */
+#define SFS_IDFIRST  SFS_NDIRECT
+#define SFS_DIDFIRST (SFS_IDFIRST + SFS_DBPERIDB)
+#define SFS_MAXFILEBLOCKS (SFS_DIDFIRST + SFS_DBPERIDB * SFS_DBPERIDB)
+
+/*
+ * Allocate a block for a file, preferably right after the last one
+ * allocated to it.
  */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+sfs_bmap_alloc(struct sfs_vnode *sv, daddr_t *ret)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	daddr_t goal;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
-
-	/*
-	 * If the block we want is one of the direct blocks...
-	 */
-	if (fileblock < SFS_NDIRECT) {
-		/*
-		 * Get the block number
-		 */
-		block = sv->sv_i.sfi_direct[fileblock];
+	goal = (sv->sv_lastblock != 0) ? sv->sv_lastblock + 1 : 0;
+	result = sfs_balloc(sfs, goal, ret);
+	if (result) {
+		return result;
+	}
+	sv->sv_lastblock = *ret;
+	return 0;
+}
 
-		/*
-		 * Do we need to allocate?
-		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
-			if (result) {
-				return result;
-			}
+/*
+ * Get the block number stored in *PTR, a block pointer in the
+ * inode. If it's 0 and DOALLOC is set, allocate a block and store
+ * it there.
+ */
+static
+int
+sfs_bmap_inode(struct sfs_vnode *sv, uint32_t *ptr, bool doalloc,
+	       daddr_t *ret)
+{
+	daddr_t block;
+	int result;
 
-			/* Remember what we allocated; mark inode dirty */
-			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+	block = *ptr;
+	if (block==0 && doalloc) {
+		result = sfs_bmap_alloc(sv, &block);
+		if (result) {
+			return result;
 		}
 
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: %s: Data block %u (block %u of file %u) "
-			      "marked free\n", sfs->sfs_sb.sb_volname,
-			      block, fileblock, sv->sv_ino);
-		}
-		*diskblock = block;
-		return 0;
+		/* Remember what we allocated; mark inode dirty */
+		*ptr = block;
+		sv->sv_dirty = true;
 	}
+	*ret = block;
+	return 0;
+}
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
+/*
+ * Get entry IDOFF of indirect block IDBLOCK. If it's 0 and DOALLOC
+ * is set, allocate a block and store it there. (If IDBLOCK was just
+ * allocated, sfs_balloc cleared it in the buffer cache, so reading
+ * it doesn't touch the disk.)
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, daddr_t idblock, uint32_t idoff,
+		  bool doalloc, daddr_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	daddr_t block;
+	int result;
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	KASSERT(idoff < SFS_DBPERIDB);
 
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	result = sfs_readbuf(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
+	iddata = buffer_map(idbuf);
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+	block = iddata[idoff];
+	if (block==0 && doalloc) {
+		result = sfs_bmap_alloc(sv, &block);
 		if (result) {
+			buffer_release(idbuf);
 			return result;
 		}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+		/* Remember the block we allocated */
+		iddata[idoff] = block;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* The indirect block is now dirty */
+		buffer_mark_dirty(idbuf);
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	buffer_release(idbuf);
+
+	*ret = block;
+	return 0;
+}
+
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated.
+ *
+ * If no block is mapped and DOALLOC is not set, hands back 0; a
+ * missing indirect block is treated as if it were all zeros.
+ *
+ * New blocks go right after the last block allocated to the file,
+ * if that's free, so that files written sequentially are laid out
+ * contiguously. If nothing has been allocated to the file since the
+ * vnode was loaded (or truncated), the goal is instead the block
+ * after the one holding the preceding block of the file.
+ */
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block, idblock, didblock;
+	uint32_t idnum, idoff;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (doalloc && sv->sv_lastblock == 0 && fileblock > 0 &&
+	    fileblock < SFS_MAXFILEBLOCKS) {
+		/* Not allocated anything yet; use the preceding block. */
+		result = sfs_bmap(sv, fileblock - 1, false, &block);
 		if (result) {
 			return result;
 		}
+		sv->sv_lastblock = block;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	if (fileblock < SFS_IDFIRST) {
+		/* It's one of the direct blocks. */
+		result = sfs_bmap_inode(sv, &sv->sv_i.sfi_direct[fileblock],
+					doalloc, &block);
 		if (result) {
 			return result;
 		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+	}
+	else if (fileblock < SFS_DIDFIRST) {
+		/* It's in the indirect block. */
+		result = sfs_bmap_inode(sv, &sv->sv_i.sfi_indirect,
+					doalloc, &idblock);
 		if (result) {
 			return result;
 		}
+		block = 0;
+		if (idblock != 0) {
+			result = sfs_bmap_indirect(sv, idblock,
+						   fileblock - SFS_IDFIRST,
+						   doalloc, &block);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	else if (fileblock < SFS_MAXFILEBLOCKS) {
+		/*
+		 * It's under the double indirect block. Find which
+		 * second-level indirect block, and the offset in it.
+		 */
+		idnum = (fileblock - SFS_DIDFIRST) / SFS_DBPERIDB;
+		idoff = (fileblock - SFS_DIDFIRST) % SFS_DBPERIDB;
+
+		if (sv->sv_idcacheblock != 0 && sv->sv_idcachenum == idnum) {
+			/* Same one as last time */
+			idblock = sv->sv_idcacheblock;
+		}
+		else {
+			result = sfs_bmap_inode(sv, &sv->sv_i.sfi_dindirect,
+						doalloc, &didblock);
+			if (result) {
+				return result;
+			}
+			idblock = 0;
+			if (didblock != 0) {
+				result = sfs_bmap_indirect(sv, didblock,
+							   idnum, doalloc,
+							   &idblock);
+				if (result) {
+					return result;
+				}
+			}
+			if (idblock != 0) {
+				sv->sv_idcachenum = idnum;
+				sv->sv_idcacheblock = idblock;
+			}
+		}
+
+		block = 0;
+		if (idblock != 0) {
+			result = sfs_bmap_indirect(sv, idblock, idoff,
+						   doalloc, &block);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	else {
+		/* Past the largest file we can map. */
+		return EFBIG;
 	}
 
 	/* Hand back the result and return. */
@@ -198,34 +265,104 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free the blocks mapped by indirect block IDBLOCK that fall at or
+ * past BLOCKLEN, the new length of the file in blocks. Entry 0 of
+ * IDBLOCK maps file block BASE. If LEVELS is 1, its entries are data
+ * blocks; if 2, they are themselves indirect blocks. Sets *EMPTY if
+ * nothing is left in IDBLOCK, in which case the caller should free
+ * it.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, daddr_t idblock, unsigned levels,
+		    uint32_t base, uint32_t blocklen, bool *empty)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t span, first, j;
+	bool iddirty, subempty;
+	int result;
+
+	KASSERT(levels == 1 || levels == 2);
+	span = (levels == 1) ? 1 : SFS_DBPERIDB;
+
+	result = sfs_readbuf(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	*empty = true;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (iddata[j] == 0) {
+			continue;
+		}
+
+		/* The first file block this entry maps */
+		first = base + j*span;
 
+		if (levels == 2 && first + span > blocklen) {
+			/* Some or all of it goes; recurse */
+			result = sfs_itrunc_indirect(sfs, iddata[j], 1,
+						     first, blocklen,
+						     &subempty);
+			if (result) {
+				if (iddirty) {
+					buffer_mark_dirty(idbuf);
+				}
+				buffer_release(idbuf);
+				return result;
+			}
+		}
+		else {
+			subempty = (first >= blocklen);
+		}
+
+		if (subempty) {
+			/* Discard the block, which is past the new EOF */
+			sfs_bfree(sfs, iddata[j]);
+			iddata[j] = 0;
+			iddirty = true;
+		}
+		else {
+			*empty = false;
+		}
+	}
+
+	if (*empty) {
+		/* The caller is about to free it; don't bother writing */
+		buffer_release(idbuf);
+		return 0;
+	}
+	if (iddirty) {
+		buffer_mark_dirty(idbuf);
+	}
+	buffer_release(idbuf);
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i;
+	daddr_t block;
+	bool empty;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/* Any cached mapping or allocation goal may be about to go away. */
+	sv->sv_idcacheblock = 0;
+	sv->sv_lastblock = 0;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,54 +377,34 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	/* Then the indirect block... */
+	block = sv->sv_i.sfi_indirect;
+	if (block != 0 && blocklen < SFS_DIDFIRST) {
+		result = sfs_itrunc_indirect(sfs, block, 1, SFS_IDFIRST,
+					     blocklen, &empty);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
+		if (empty) {
 			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
+			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+	}
+
+	/* ...and the double indirect block. */
+	block = sv->sv_i.sfi_dindirect;
+	if (block != 0 && blocklen < SFS_MAXFILEBLOCKS) {
+		result = sfs_itrunc_indirect(sfs, block, 2, SFS_DIDFIRST,
+					     blocklen, &empty);
+		if (result) {
+			return result;
+		}
+		if (empty) {
+			sfs_bfree(sfs, block);
+			sv->sv_i.sfi_dindirect = 0;
+			sv->sv_dirty = true;
 		}
 	}
 
@@ -297,7 +414,87 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Write out the dirty cached blocks mapped by indirect block IDBLOCK
+ * (LEVELS as for sfs_itrunc_indirect), and then IDBLOCK itself.
+ */
+static
+int
+sfs_flushindirect(struct sfs_fs *sfs, daddr_t idblock, unsigned levels)
+{
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t i;
+	int result;
+
+	result = sfs_readbuf(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		if (iddata[i] == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			result = sfs_flushindirect(sfs, iddata[i], levels-1);
+		}
+		else {
+			result = buffer_flush(sfs->sfs_device, iddata[i]);
+		}
+		if (result) {
+			buffer_release(idbuf);
+			return result;
+		}
+	}
+
+	result = buffer_sync(idbuf);
+	buffer_release(idbuf);
+	return result;
+}
+
+/*
+ * Write out any dirty cached blocks of a file: its data blocks and
+ * its indirect blocks. Called from fsync; the inode itself is
+ * handled by the caller.
+ */
+int
+sfs_flushblocks(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	uint32_t i;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (block != 0) {
+			result = buffer_flush(sfs->sfs_device, block);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	if (sv->sv_i.sfi_indirect != 0) {
+		result = sfs_flushindirect(sfs, sv->sv_i.sfi_indirect, 1);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (sv->sv_i.sfi_dindirect != 0) {
+		result = sfs_flushindirect(sfs, sv->sv_i.sfi_dindirect, 2);
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
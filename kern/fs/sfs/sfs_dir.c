@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -85,6 +86,7 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	off_t size;
 
 	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	size = sv->sv_i.sfi_size;
 	if (size % sizeof(struct sfs_direntry) != 0) {
@@ -95,6 +97,225 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Directory index
+//
+// Scanning every slot of a big directory on every lookup is slow, so
+// the first lookup in a directory builds an in-memory index: a hash
+// of each name, mapped to its slot and inode number, plus a list of
+// the empty slots. Hash collisions are resolved by reading the slot
+// (which is normally in the buffer cache) and comparing the name.
+// The on-disk format is unchanged.
+//
+// The index lives as long as the vnode does and is kept up to date
+// by sfs_dir_link and sfs_dir_unlink. If memory runs out while
+// updating it, it is thrown away and rebuilt on the next lookup; if
+// it can't be built at all, lookups fall back to a linear scan.
+
+#define SFS_DIRHASHSIZE 256
+
+struct sfs_dirslot {
+	struct sfs_dirslot *ds_next;	/* next in chain */
+	uint32_t ds_hash;		/* hash of the name */
+	uint32_t ds_ino;		/* inode number */
+	int ds_slot;			/* slot in the directory */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirslot *di_hash[SFS_DIRHASHSIZE];	/* used slots */
+	struct sfs_dirslot *di_free;			/* empty slots */
+};
+
+/*
+ * Hash a filename. (This is the djb2 hash.)
+ */
+static
+uint32_t
+sfs_dir_hashname(const char *name)
+{
+	uint32_t hash = 5381;
+
+	while (*name) {
+		hash = hash*33 + (unsigned char)*name++;
+	}
+	return hash;
+}
+
+/*
+ * Throw away a directory's index.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirslot *ds;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+	for (i=0; i<SFS_DIRHASHSIZE; i++) {
+		while ((ds = di->di_hash[i]) != NULL) {
+			di->di_hash[i] = ds->ds_next;
+			kfree(ds);
+		}
+	}
+	while ((ds = di->di_free) != NULL) {
+		di->di_free = ds->ds_next;
+		kfree(ds);
+	}
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Record slot SLOT in the index: in use with name NAME and inode INO,
+ * or empty if NAME is NULL. Reuses DS if not NULL.
+ */
+static
+int
+sfs_dir_indexslot(struct sfs_dirindex *di, struct sfs_dirslot *ds,
+		  int slot, const char *name, uint32_t ino)
+{
+	struct sfs_dirslot **head;
+
+	if (ds == NULL) {
+		ds = kmalloc(sizeof(*ds));
+		if (ds == NULL) {
+			return ENOMEM;
+		}
+	}
+	ds->ds_slot = slot;
+	ds->ds_ino = ino;
+	if (name != NULL) {
+		ds->ds_hash = sfs_dir_hashname(name);
+		head = &di->di_hash[ds->ds_hash % SFS_DIRHASHSIZE];
+	}
+	else {
+		ds->ds_hash = 0;
+		head = &di->di_free;
+	}
+	ds->ds_next = *head;
+	*head = ds;
+	return 0;
+}
+
+/*
+ * Build the index for a directory by reading all its entries.
+ * Failure is not fatal; it just leaves the directory unindexed.
+ */
+static
+int
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di;
+	struct sfs_direntry tsd;
+	int nentries, i, result;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_DIRHASHSIZE; i++) {
+		di->di_hash[i] = NULL;
+	}
+	di->di_free = NULL;
+	sv->sv_dirindex = di;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			result = sfs_dir_indexslot(di, NULL, i, NULL, 0);
+		}
+		else {
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			result = sfs_dir_indexslot(di, NULL, i, tsd.sfd_name,
+						   tsd.sfd_ino);
+		}
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the index record for slot SLOT, which must be in use with
+ * a name whose hash is HASH, and unchain it.
+ */
+static
+struct sfs_dirslot *
+sfs_dir_unindexslot(struct sfs_dirindex *di, uint32_t hash, int slot)
+{
+	struct sfs_dirslot **pp, *ds;
+
+	for (pp = &di->di_hash[hash % SFS_DIRHASHSIZE];
+	     *pp != NULL;
+	     pp = &(*pp)->ds_next) {
+		if ((*pp)->ds_slot == slot) {
+			ds = *pp;
+			*pp = ds->ds_next;
+			return ds;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Look up NAME using the index. Same interface as sfs_dir_findname.
+ */
+static
+int
+sfs_dir_indexfind(struct sfs_vnode *sv, const char *name,
+		  uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_direntry tsd;
+	struct sfs_dirslot *ds;
+	uint32_t hash;
+	int result;
+
+	if (emptyslot != NULL && di->di_free != NULL) {
+		*emptyslot = di->di_free->ds_slot;
+	}
+
+	hash = sfs_dir_hashname(name);
+	for (ds = di->di_hash[hash % SFS_DIRHASHSIZE];
+	     ds != NULL;
+	     ds = ds->ds_next) {
+		if (ds->ds_hash != hash) {
+			continue;
+		}
+		result = sfs_readdir(sv, ds->ds_slot, &tsd);
+		if (result) {
+			return result;
+		}
+		KASSERT(tsd.sfd_ino == ds->ds_ino);
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (!strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = ds->ds_slot;
+			}
+			if (ino != NULL) {
+				*ino = ds->ds_ino;
+			}
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -107,6 +328,14 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
 
+	if (sv->sv_dirindex == NULL) {
+		/* If this fails, just do it the slow way */
+		(void)sfs_dir_buildindex(sv);
+	}
+	if (sv->sv_dirindex != NULL) {
+		return sfs_dir_indexfind(sv, name, ino, slot, emptyslot);
+	}
+
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
@@ -156,6 +385,8 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -186,7 +417,24 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Update the index, if any. */
+	di = sv->sv_dirindex;
+	if (di != NULL) {
+		ds = NULL;
+		if (di->di_free != NULL && di->di_free->ds_slot == emptyslot) {
+			ds = di->di_free;
+			di->di_free = ds->ds_next;
+		}
+		if (sfs_dir_indexslot(di, ds, emptyslot, name, ino)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -196,13 +444,42 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+	uint32_t hash = 0;
+	int result;
+
+	/* If indexed, we need the old name to find the index record. */
+	di = sv->sv_dirindex;
+	if (di != NULL) {
+		result = sfs_readdir(sv, slot, &sd);
+		if (result) {
+			return result;
+		}
+		KASSERT(sd.sfd_ino != SFS_NOINO);
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		hash = sfs_dir_hashname(sd.sfd_name);
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Move the slot to the free list in the index. */
+	if (di != NULL) {
+		ds = sfs_dir_unindexslot(di, hash, slot);
+		KASSERT(ds != NULL);
+		result = sfs_dir_indexslot(di, ds, slot, NULL, 0);
+		/* reusing DS can't fail */
+		KASSERT(result == 0);
+	}
+	return 0;
 }
 
 /*
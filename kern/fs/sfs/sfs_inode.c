@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -42,6 +43,7 @@
 
 /*
  * Write an on-disk inode structure back out to disk.
+ * (Or at least to the buffer cache.) Requires the vnode lock.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,6 +51,8 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
 					sizeof(sv->sv_i));
@@ -60,9 +64,233 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Vnode table
+//
+// All of these require sfs_vnlock.
+
+/*
+ * Find a loaded vnode by inode number.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[ino % SFS_VNHASHSIZE];
+	     sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a newly loaded vnode to the table.
+ */
+static
+int
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned bucket;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn,
+				&sv->sv_tableix);
+	if (result) {
+		return result;
+	}
+
+	bucket = sv->sv_ino % SFS_VNHASHSIZE;
+	sv->sv_hashnext = sfs->sfs_vnhash[bucket];
+	sfs->sfs_vnhash[bucket] = sv;
+	return 0;
+}
+
+/*
+ * Take a vnode out of the table. The array is kept dense by moving
+ * the last entry into the hole.
+ */
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+	struct vnode *last;
+	unsigned num;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (pp = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASHSIZE];
+	     *pp != sv;
+	     pp = &(*pp)->sv_hashnext) {
+		if (*pp == NULL) {
+			panic("sfs: %s: vnode %u not in vnode table\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+	}
+	*pp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_tableix < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_tableix) ==
+		&sv->sv_absvn);
+	last = vnodearray_get(sfs->sfs_vnodes, num-1);
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_tableix, last);
+	((struct sfs_vnode *)last->vn_data)->sv_tableix = sv->sv_tableix;
+	/* shrinking never fails */
+	vnodearray_setsize(sfs->sfs_vnodes, num-1);
+}
+
+/*
+ * Put an unreferenced vnode at the recent end of the cache.
+ */
+static
+void
+sfs_vncache_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_cached);
+
+	sv->sv_cached = true;
+	sv->sv_lruprev = NULL;
+	sv->sv_lrunext = sfs->sfs_lruhead;
+	if (sfs->sfs_lruhead != NULL) {
+		sfs->sfs_lruhead->sv_lruprev = sv;
+	}
+	else {
+		sfs->sfs_lrutail = sv;
+	}
+	sfs->sfs_lruhead = sv;
+	sfs->sfs_ncached++;
+}
+
+/*
+ * Take a vnode off the cache list.
+ */
+static
+void
+sfs_vncache_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_cached);
+
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_lruhead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_lrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_cached = false;
+	KASSERT(sfs->sfs_ncached > 0);
+	sfs->sfs_ncached--;
+}
+
+/*
+ * Evict cached vnodes, starting from the least recently used, until
+ * no more than MAXCACHED are left. The victims are taken out of the
+ * table and returned chained through sv_hashnext, to be destroyed
+ * with sfs_vnode_destroylist once sfs_vnlock is released.
+ *
+ * A cached vnode's only reference belongs to the cache, unless
+ * sfs_sync_vnodes has borrowed it; such a vnode is left alone.
+ */
+static
+struct sfs_vnode *
+sfs_vncache_trim(struct sfs_fs *sfs, unsigned maxcached)
+{
+	struct sfs_vnode *sv, *prev, *victims = NULL;
+	bool busy;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_lrutail;
+	     sv != NULL && sfs->sfs_ncached > maxcached;
+	     sv = prev) {
+		prev = sv->sv_lruprev;
+
+		spinlock_acquire(&sv->sv_absvn.vn_countlock);
+		busy = sv->sv_absvn.vn_refcount != 1;
+		spinlock_release(&sv->sv_absvn.vn_countlock);
+		if (busy) {
+			continue;
+		}
+
+		sfs_vncache_remove(sfs, sv);
+		sfs_vntable_remove(sfs, sv);
+		sv->sv_hashnext = victims;
+		victims = sv;
+	}
+	return victims;
+}
+
+/*
+ * Free a list of vnodes from sfs_vncache_trim. They are already
+ * unreachable, but whoever put one in the cache may not have let go
+ * of its lock yet, so wait for that.
+ */
+static
+void
+sfs_vnode_destroylist(struct sfs_vnode *victims)
+{
+	struct sfs_vnode *sv;
+
+	while (victims != NULL) {
+		sv = victims;
+		victims = sv->sv_hashnext;
+
+		lock_acquire(sv->sv_lock);
+		/* cached vnodes are synced on the way in */
+		KASSERT(!sv->sv_dirty);
+		sfs_dir_dropindex(sv);
+		lock_release(sv->sv_lock);
+
+		lock_destroy(sv->sv_lock);
+		vnode_cleanup(&sv->sv_absvn);
+		kfree(sv);
+	}
+}
+
+/*
+ * Drop all cached vnodes. Called at unmount time.
+ */
+void
+sfs_purgevnodes(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *victims;
+
+	lock_acquire(sfs->sfs_vnlock);
+	victims = sfs_vncache_trim(sfs, 0);
+	lock_release(sfs->sfs_vnlock);
+
+	sfs_vnode_destroylist(victims);
+}
+
+////////////////////////////////////////////////////////////
+// Vnode lifecycle
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
+ * If the file still exists on disk, the vnode is synced and kept in
+ * the cache, which takes over the last reference; otherwise it is
+ * destroyed, and the file with it.
+ *
  * This function should try to avoid returning errors other than EBUSY.
  */
 int
@@ -70,15 +298,21 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode *victims;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Lock the vnode, then the vnode table, so sfs_loadvnode can't
+	 * hand out the vnode while we're getting rid of it.
+	 */
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
+
+	KASSERT(!sv->sv_cached);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,7 +322,8 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
@@ -97,7 +332,8 @@ sfs_reclaim(struct vnode *v)
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
 			return result;
 		}
 	}
@@ -105,35 +341,40 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	if (sv->sv_i.sfi_linkcount > 0) {
+		/* Keep it around in case it's wanted again soon. */
+		sfs_vncache_add(sfs, sv);
+		victims = sfs_vncache_trim(sfs, SFS_VNCACHEMAX);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+
+		sfs_vnode_destroylist(victims);
+		return 0;
 	}
 
+	/* There are no on-disk references, so discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
+
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vntable_remove(sfs, sv);
 
-	vnode_cleanup(&sv->sv_absvn);
+	sfs_dir_dropindex(sv);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Nobody else can have a reference to the vnode now, or get
+	 * one, so nobody can be waiting for its lock.
+	 */
+	lock_release(sv->sv_lock);
+	lock_destroy(sv->sv_lock);
+
+	vnode_cleanup(&sv->sv_absvn);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -150,42 +391,35 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		if (sv->sv_cached) {
+			/* Take over the reference the cache was holding */
+			sfs_vncache_remove(sfs, sv);
 		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
+		else {
 			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -199,12 +433,28 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No reads yet */
+	sv->sv_rapos = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+
+	/* No block mappings cached */
+	sv->sv_idcachenum = 0;
+	sv->sv_idcacheblock = 0;
+
+	/* Nothing allocated yet */
+	sv->sv_lastblock = 0;
+
+	/* Directory index is built on first use */
+	sv->sv_dirindex = NULL;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
@@ -236,20 +486,35 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_hashnext = NULL;
+	sv->sv_cached = false;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		vnode_cleanup(&sv->sv_absvn);
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
+	result = sfs_vntable_add(sfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		vnode_cleanup(&sv->sv_absvn);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -269,7 +534,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +561,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
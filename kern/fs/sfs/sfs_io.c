@@ -35,9 +35,10 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
-#include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,6 +47,8 @@
 // Basic block-level I/O routines
 
 /*
+ * All block I/O goes through the buffer cache.
+ *
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
@@ -53,82 +56,67 @@
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Get a buffer for a block, reading it in if it isn't cached.
  */
-static
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_readbuf(struct sfs_fs *sfs, daddr_t block, struct buf **ret)
 {
-	int result;
-	int tries=0;
-
-	KASSERT(vfs_biglock_do_i_hold());
-
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	DEBUG(DB_SFS, "sfs: get %u\n", block);
+	return buffer_read(sfs->sfs_device, block, SFS_BLOCKSIZE, ret);
+}
 
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
-	}
-	return result;
+/*
+ * Get a buffer for a block that the caller is going to overwrite
+ * completely, without reading it.
+ */
+int
+sfs_getbuf(struct sfs_fs *sfs, daddr_t block, struct buf **ret)
+{
+	DEBUG(DB_SFS, "sfs: get %u (no read)\n", block);
+	return buffer_get(sfs->sfs_device, block, SFS_BLOCKSIZE, ret);
 }
 
 /*
- * Read a block.
+ * Read a block into a caller-supplied area.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_readbuf(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block from a caller-supplied area. This only updates the
+ * cache; the block reaches the disk when the buffer cache's syncer
+ * gets to it, or on fsync/sync/unmount.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_getbuf(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -137,9 +125,13 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * need the original contents of the block first, even if we're
+ * writing, so we don't clobber the portion of the block we're not
+ * intending to write over.
+ *
+ * The I/O is done directly on the block's buffer in the buffer
+ * cache, so there's no need for an intermediate copy, and partial
+ * I/O on different blocks doesn't share any state.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,16 +142,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +153,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,40 +165,36 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block. (If it was just allocated, sfs_balloc cleared
+	 * it in the cache, so this doesn't need to go to disk.)
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_readbuf(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove((char *)buffer_map(buf) + skipstart, len, uio);
+
+	/*
+	 * If it was a write, the block is now dirty. (Even if the
+	 * copy failed partway; whatever made it in is there now.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(buf);
 	}
+	buffer_release(buf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -228,14 +205,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -258,31 +232,107 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Get the block's buffer. If we're writing, we're going to
+	 * overwrite the whole thing, so there's no need to read it.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_readbuf(sfs, diskblock, &buf);
+	}
+	else {
+		result = sfs_getbuf(sfs, diskblock, &buf);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	result = uiomove(buffer_map(buf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		/*
+		 * If the copy failed partway, the buffer only holds
+		 * part of the new data; unless it was already valid,
+		 * leave it invalid so it gets reread from disk.
+		 */
+		if (result == 0 || buffer_is_valid(buf)) {
+			buffer_mark_dirty(buf);
+		}
+	}
+	buffer_release(buf);
 
-	result = sfs_rwblock(sfs, uio);
+	return result;
+}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/*
+ * Read-ahead window limits, in blocks.
+ */
+#define SFS_RAMIN  4
+#define SFS_RAMAX  64
 
-	return result;
+/*
+ * Sequential read detection and read-ahead.
+ *
+ * A read is sequential if it starts where the previous read of the
+ * file left off. (This is tracked per vnode rather than per open
+ * file, since the vnode layer doesn't tell us which open file a read
+ * comes from; two processes reading the same file at once will just
+ * defeat it.) Each sequential read doubles the window, up to
+ * SFS_RAMAX blocks; anything else turns read-ahead off until the
+ * reader settles down again.
+ *
+ * When the blocks already requested run to less than half a window
+ * past the end of the current read, request the next window's worth
+ * from the buffer cache. The cache reads them in the background, so
+ * by the time the reader gets there they should already be in
+ * memory.
+ *
+ * POS is where the current read starts and LAST is the last file
+ * block it covers.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t pos, uint32_t last)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblocks, end, block;
+	daddr_t diskblock;
+
+	if (pos != sv->sv_rapos) {
+		/* Random access; stop reading ahead. */
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		return;
+	}
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RAMIN;
+	}
+	else if (sv->sv_rawindow < SFS_RAMAX) {
+		sv->sv_rawindow *= 2;
+	}
+
+	/* Don't redo what's already been requested. */
+	if (sv->sv_raend < last + 1) {
+		sv->sv_raend = last + 1;
+	}
+	if (sv->sv_raend - (last + 1) >= sv->sv_rawindow / 2) {
+		return;
+	}
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	end = last + 1 + sv->sv_rawindow;
+	if (end > fileblocks) {
+		end = fileblocks;
+	}
+
+	for (block = sv->sv_raend; block < end; block++) {
+		if (sfs_bmap(sv, block, false, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock,
+					 SFS_BLOCKSIZE);
+		}
+	}
+	sv->sv_raend = block;
 }
 
 /*
@@ -296,6 +346,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	origresid = uio->uio_resid;
 
 	/*
@@ -317,6 +369,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		/* Start fetching what comes next, if it's sequential. */
+		sfs_readahead(sv, uio->uio_offset,
+			      (uio->uio_offset + uio->uio_resid - 1)
+			      / SFS_BLOCKSIZE);
 	}
 
 	/*
@@ -373,6 +430,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	/* Remember where a sequential reader would continue from */
+	if (uio->uio_rw == UIO_READ) {
+		sv->sv_rapos = uio->uio_offset;
+	}
+
 	/* If writing and we did anything, adjust file length */
 	if (uio->uio_resid != origresid &&
 	    uio->uio_rw == UIO_WRITE &&
@@ -411,20 +473,12 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
+	struct buf *buf;
+	char *ioptr;
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,26 +500,25 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = sfs_readbuf(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
+		buffer_release(buf);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
+		memcpy(ioptr + blockoffset, data, len);
 
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* The block is now dirty */
+		buffer_mark_dirty(buf);
+		buffer_release(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
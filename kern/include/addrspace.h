@@ -83,6 +83,8 @@ struct addrspace {
         struct region *regions;
         struct entry *page_table[TABLE_SIZE]; 
         bool isLoading;
+        unsigned npages;        // resident pages, for RLIMIT_RSS
+        size_t vsize;           // total size of regions, for RLIMIT_AS
 
 #endif
 };
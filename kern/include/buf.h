@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * The buffer cache holds copies of disk blocks in memory, keyed by
+ * the device they live on and their block number. Filesystems get
+ * at disk blocks by getting a buffer handle, reading or writing the
+ * data it maps, and releasing the handle. A buffer is never evicted
+ * while anyone holds a handle to it; otherwise buffers are recycled
+ * in CLOCK (second chance) order, and a dirty buffer is written out
+ * before its memory is reused.
+ *
+ * Writes are delayed. Marking a buffer dirty does no I/O; a syncer
+ * thread writes dirty buffers back after a few seconds, or sooner if
+ * too much of the cache is dirty. Use buffer_sync, buffer_flush or
+ * buffer_sync_device when the data must be on disk.
+ *
+ * The cache does not serialize access to the contents of a buffer;
+ * that is up to the filesystem, which already has to lock the
+ * objects the blocks belong to.
+ *
+ * Functions:
+ *     buffer_bootstrap   - set up the cache and start its threads.
+ *     buffer_get         - get a handle for a block without reading it.
+ *                          If the buffer is not already valid, the caller
+ *                          must fill the whole block and mark it dirty.
+ *     buffer_read        - get a handle for a block, reading it from the
+ *                          device if it is not already cached.
+ *     buffer_readahead   - start reading a block into the cache in the
+ *                          background, if it isn't there already.
+ *     buffer_release     - give back a handle.
+ *     buffer_map         - return a pointer to the buffer's data.
+ *     buffer_is_valid    - check if the buffer holds the block's contents.
+ *     buffer_mark_dirty  - note that the buffer's data has been changed.
+ *                          This also marks the buffer valid.
+ *     buffer_sync        - write a buffer out now if it is dirty.
+ *     buffer_flush       - write a block out now if it is cached and
+ *                          dirty, without needing a handle.
+ *     buffer_drop        - discard a block that is no longer in use
+ *                          (e.g. freed by the filesystem) without
+ *                          writing it back.
+ *     buffer_sync_device - write out all dirty buffers for a device.
+ *     buffer_drop_device - discard all buffers for a device; used on
+ *                          unmount after buffer_sync_device. No handles
+ *                          for the device may be held.
+ *     buffer_printstats  - print hit/miss statistics.
+ *
+ * The size argument must be the same for every request for a given
+ * block, and no larger than BUFFER_MAXSIZE.
+ */
+
+struct device;
+struct buf;  /* Opaque. */
+
+/* Largest block size the cache supports. */
+#define BUFFER_MAXSIZE 512
+
+void buffer_bootstrap(void);
+
+int buffer_get(struct device *dev, daddr_t block, size_t size,
+	       struct buf **ret);
+int buffer_read(struct device *dev, daddr_t block, size_t size,
+		struct buf **ret);
+void buffer_readahead(struct device *dev, daddr_t block, size_t size);
+void buffer_release(struct buf *buf);
+
+void *buffer_map(struct buf *buf);
+bool buffer_is_valid(struct buf *buf);
+void buffer_mark_dirty(struct buf *buf);
+int buffer_sync(struct buf *buf);
+int buffer_flush(struct device *dev, daddr_t block);
+void buffer_drop(struct device *dev, daddr_t block);
+
+int buffer_sync_device(struct device *dev);
+void buffer_drop_device(struct device *dev);
+
+void buffer_printstats(void);
+
+
+#endif /* _BUF_H_ */
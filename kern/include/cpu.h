@@ -59,6 +59,7 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Exited threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
@@ -70,6 +71,16 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus without locking.
+	 * Written only with the runqueue lock held.
+	 *
+	 * c_nready mirrors c_runqueue.tl_count so idle cpus can pick a
+	 * cpu to steal work from without taking every runqueue lock.
+	 * It is only a hint; recheck under the lock before relying on it.
+	 */
+	volatile unsigned c_nready;	/* Run queue length hint */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
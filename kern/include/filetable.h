@@ -38,15 +38,14 @@
 
 
 /*
- * The file table is an array of open files.
+ * The file table is a growable array of open files. It starts small
+ * and doubles as needed, up to OPEN_MAX. A bitmap of the slots in
+ * use finds the lowest free descriptor without scanning the array,
+ * and ft_nopen lets destroy and copy stop once they've seen every
+ * open file, so a process with a few files pays for a few files.
  *
- * There is no particular reason to use a fixed size array (of size
- * OPEN_MAX) instead of a dynamically sized array (using array.h) --
- * the code was just written this way years ago and there's no
- * compelling reason to change it that outweighs this benefit: you can
- * look through the code to see what it would take to make it dynamic,
- * or even to make it dynamic with the limit being user-settable. (See
- * setrlimit(2) on a Unix machine.)
+ * ft_limit is the process's RLIMIT_NOFILE; new descriptors are
+ * always below it.
  *
  * Because we only have single-threaded processes, the file table is
  * never shared and so it doesn't require synchronization. On fork,
@@ -56,7 +55,11 @@
  * read() using the same file handle?
  */
 struct filetable {
-	struct openfile *ft_openfiles[OPEN_MAX];
+	struct openfile **ft_openfiles;	/* ft_size slots */
+	struct bitmap *ft_inuse;	/* which slots are non-NULL */
+	unsigned ft_size;		/* number of slots allocated */
+	unsigned ft_nopen;		/* number of slots in use */
+	int ft_limit;			/* RLIMIT_NOFILE; new fds are below */
 };
 
 /*
@@ -66,12 +69,15 @@ struct filetable {
  * destroy - Wipe out a file table, closing anything open in it.
  * copy -    Clone a file table.
  * okfd -    Check if a file handle is in range.
+ * grow -    Make sure the table has a slot for a given in-range fd.
  * get/put - Retrieve a fd for use and put it back when done. (Checks
  *           okfd and also fails on files not open; returned openfile
  *           is not NULL.) Call put with the file returned from get.
  * place -   Insert a file and return the fd.
  * placeat - Insert a file at a specific slot and return the file
  *           previously there.
+ * setlimit - Set the bound on new descriptors (RLIMIT_NOFILE).
+ *           Descriptors already open above it stay usable.
  */
 
 struct filetable *filetable_create(void);
@@ -79,12 +85,14 @@ void filetable_destroy(struct filetable *ft);
 int filetable_copy(struct filetable *src, struct filetable **dest_ret);
 
 bool filetable_okfd(struct filetable *ft, int fd);
+int filetable_grow(struct filetable *ft, int fd);
 int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
 void filetable_put(struct filetable *ft, int fd, struct openfile *file);
 
 int filetable_place(struct filetable *ft, struct openfile *file, int *fd);
 void filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
 		       struct openfile **oldfile_ret);
+void filetable_setlimit(struct filetable *ft, rlim_t limit);
 
 
 #endif /* _FILETABLE_H_ */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * Name cache.
+ *
+ * The name cache remembers the results of looking up single path
+ * components: (directory vnode, name) maps to the vnode found, or to
+ * nothing if the lookup failed with ENOENT (a negative entry). Both
+ * vnodes of a cached entry are referenced. vfs_lookup consults the
+ * cache before asking the filesystem.
+ *
+ * Entries are invalidated by name: whenever an operation may add,
+ * remove or change a name, every entry with that name on the same
+ * filesystem is thrown away. This is coarser than necessary but
+ * cannot miss, even if a filesystem hands out more than one vnode
+ * for the same directory.
+ *
+ * Functions:
+ *     namecache_bootstrap  - set up the cache.
+ *     namecache_lookup     - look up NAME in DIR. Returns true if it
+ *                            was found; *RET is then either a new
+ *                            reference to the vnode, or NULL for a
+ *                            negative entry. On a miss, returns false
+ *                            and sets *GEN for passing to
+ *                            namecache_enter.
+ *     namecache_enter      - record the result of a lookup the cache
+ *                            missed: VN, or NULL if there is no such
+ *                            name. Does nothing if anything has been
+ *                            invalidated since the lookup that
+ *                            returned GEN, as the result may be stale.
+ *     namecache_remove     - invalidate NAME in DIR's filesystem. Call
+ *                            after any operation that may have changed
+ *                            what NAME refers to.
+ *     namecache_purgefs    - invalidate all entries for a filesystem,
+ *                            dropping their vnode references; used
+ *                            before unmounting.
+ *     namecache_printstats - print hit/miss statistics.
+ */
+
+struct fs;
+struct vnode;
+
+/* Longer names are not cached. */
+#define NAMECACHE_NAMELEN 31
+
+void namecache_bootstrap(void);
+
+bool namecache_lookup(struct vnode *dir, const char *name,
+		      struct vnode **ret, unsigned *gen);
+void namecache_enter(struct vnode *dir, const char *name,
+		     struct vnode *vn, unsigned gen);
+void namecache_remove(struct vnode *dir, const char *name);
+void namecache_purgefs(struct fs *fs);
+
+void namecache_printstats(void);
+
+
+#endif /* _NAMECACHE_H_ */
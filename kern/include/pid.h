@@ -38,15 +38,17 @@
 #define INVALID_PID	0	/* nothing has this pid */
 #define KERNEL_PID	1	/* kernel proc has this pid */
 
+struct proc;
+
 /*
  * Initialize pid management.
  */
 void pid_bootstrap(void);
 
 /*
- * Get a pid for a new thread.
+ * Get a pid for a new process PROC.
  */
-int pid_alloc(pid_t *retval);
+int pid_alloc(struct proc *proc, pid_t *retval);
 
 /*
  * Undo pid_alloc (may blow up if the target has ever run)
@@ -70,5 +72,11 @@ void pid_setexitstatus(int status);
  */
 int pid_wait(pid_t targetpid, int *status, int flags, pid_t *retpid);
 
+/*
+ * Get or set the nice value of the (live) process with pid PID.
+ */
+int pid_getnice(pid_t pid, int *ret);
+int pid_setnice(pid_t pid, int nice);
+
 
 #endif /* _PID_H_ */
@@ -36,6 +36,8 @@
  * Note: curproc is defined by <current.h>.
  */
 
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 
@@ -58,6 +60,12 @@ struct proc {
 	struct spinlock p_lock;		/* Lock for rest of this structure */
 	pid_t p_pid;			/* Process ID */
 
+	/* Scheduling */
+	int p_nice;			/* nice value, inherited on fork */
+
+	/* Resource limits, inherited on fork; protected by p_lock */
+	struct rlimit p_rlimits[__RLIMIT_NUM];
+
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
 
@@ -107,5 +115,26 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/*
+ * Get or set the nice value of a process. Setting it also updates
+ * all the process's threads.
+ */
+int proc_getnice(struct proc *proc);
+void proc_setnice(struct proc *proc, int nice);
+
+/*
+ * Resource limits (see getrlimit(2)). proc_getlimit returns the soft
+ * limit for WHICH; proc_setrlimit fails with EPERM on an attempt to
+ * raise the hard limit. The limits are enforced by:
+ *
+ *    RLIMIT_AS      as_define_region
+ *    RLIMIT_RSS     vm_fault
+ *    RLIMIT_NOFILE  filetable_place and dup2
+ *    RLIMIT_NPROC   pid_alloc (counts the caller's children)
+ */
+rlim_t proc_getlimit(struct proc *proc, int which);
+void proc_getrlimit(struct proc *proc, int which, struct rlimit *ret);
+int proc_setrlimit(struct proc *proc, int which, const struct rlimit *rl);
+
 
 #endif /* _PROC_H_ */
@@ -48,6 +48,42 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * Each vnode has a sleep lock, sv_lock, which protects its in-memory
+ * inode (sv_i and sv_dirty), read-ahead state, block mapping cache,
+ * allocation goal and directory index, and which is held across all
+ * I/O on the file's blocks: data, indirect blocks, and for
+ * directories, entries. The exceptions are sfi_type, which never
+ * changes once the vnode is loaded, and sfi_linkcount, which is only
+ * changed with both the directory and the file locked, and so can
+ * be read holding either.
+ *
+ * sfs_vnlock protects the table of loaded vnodes (the array, the
+ * hash chains, and the cache of unreferenced vnodes, along with the
+ * sv_hashnext, sv_tableix, sv_lru* and sv_cached fields of each
+ * vnode), and is held while loading or reclaiming one so the two
+ * can't cross. sfs_freemaplock protects the free block bitmap and
+ * the allocation hint. The superblock doesn't change after mount and
+ * needs no lock.
+ *
+ * Lock order:
+ *     directory sv_lock
+ *     file sv_lock
+ *     sfs_vnlock
+ *     sfs_freemaplock
+ *     the buffer cache (see buf.c)
+ *
+ * Since SFS has only the one directory, no operation ever needs to
+ * lock two directories or two files at once.
+ *
+ * vfs_biglock is not used.
+ */
+
+struct lock;  /* in synch.h */
+struct sfs_dirindex;  /* private to sfs_dir.c */
+
 /*
  * In-memory inode
  */
@@ -56,8 +92,43 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* lock for the above and I/O */
+
+	/* Vnode table linkage (see sfs_loadvnode) */
+	struct sfs_vnode *sv_hashnext;  /* next in hash chain */
+	unsigned sv_tableix;            /* index in sfs_vnodes */
+	bool sv_cached;                 /* unreferenced, on the LRU list */
+	struct sfs_vnode *sv_lruprev;   /* LRU list, more recent */
+	struct sfs_vnode *sv_lrunext;   /* LRU list, less recent */
+
+	/* Sequential read detection (see sfs_readahead) */
+	off_t sv_rapos;                 /* where the last read ended */
+	uint32_t sv_rawindow;           /* read-ahead window, in blocks */
+	uint32_t sv_raend;              /* first block not read ahead */
+
+	/*
+	 * The last second-level indirect block sfs_bmap went through,
+	 * so runs of accesses to a big file can skip the double
+	 * indirect block. Reset by sfs_itrunc.
+	 */
+	uint32_t sv_idcachenum;         /* which one, counting from 0 */
+	uint32_t sv_idcacheblock;       /* its disk block, or 0 if none */
+
+	/* Disk block last allocated to the file, or 0; see sfs_bmap */
+	daddr_t sv_lastblock;
+
+	/* Name lookup index for directories (see sfs_dir.c) */
+	struct sfs_dirindex *sv_dirindex;
 };
 
+/*
+ * Loaded vnodes are hashed by inode number. Up to SFS_VNCACHEMAX of
+ * them whose last reference has gone away are kept anyway, so that
+ * reopening a recently used file doesn't have to read its inode back.
+ */
+#define SFS_VNHASHSIZE  256
+#define SFS_VNCACHEMAX  128
+
 /*
  * In-memory info for a whole fs volume
  */
@@ -67,8 +138,15 @@ struct sfs_fs {
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* same, by inode */
+	struct sfs_vnode *sfs_lruhead;  /* most recently cached vnode */
+	struct sfs_vnode *sfs_lrutail;  /* least recently cached vnode */
+	unsigned sfs_ncached;           /* number of cached vnodes */
+	struct lock *sfs_vnlock;        /* lock for all the above */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	daddr_t sfs_freehint;           /* where to look for free blocks */
+	struct lock *sfs_freemaplock;   /* lock for sfs_freemap(dirty) */
 };
 
 /*
@@ -46,44 +46,82 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/*
+ * Per-lock contention counters. These are updated by the holder, so
+ * they need no further locking; readers may see slightly stale
+ * values. ss_spins counts trips around the wait loop, which is a
+ * handful of cycles each.
+ */
+struct spinlock_stats {
+	const char *ss_name;		/* Name, if tracked */
+	unsigned ss_acquires;		/* Total acquisitions */
+	unsigned ss_contended;		/* Acquisitions that had to wait */
+	uint64_t ss_spins;		/* Total wait loop iterations */
+};
+
 /*
  * Basic spinlock.
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * A spinlock is either test-and-set (the default) or a ticket lock.
+ * Ticket locks hand the lock out in FIFO order, so a hot lock can't
+ * starve any one cpu; they cost an extra atomic op when uncontended.
+ * For a ticket lock, splk_lock is the next ticket to hand out and
+ * splk_serving the ticket that currently owns the lock.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_serving; /* Ticket being served. */
+	bool splk_ticket;		    /* True for a ticket lock. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	struct spinlock_stats splk_stats;   /* Contention counters. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or global.
  */
+#define SPINLOCK_STATS_INITIALIZER	{ NULL, 0, 0, 0 }
 #ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
+#define SPINLOCK_INITIALIZER_MODE(ticket) \
+				{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, ticket, NULL, \
+				  SPINLOCK_STATS_INITIALIZER, \
 				  HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER_MODE(ticket) \
+				{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, ticket, NULL, \
+				  SPINLOCK_STATS_INITIALIZER }
 #endif
+#define SPINLOCK_INITIALIZER		SPINLOCK_INITIALIZER_MODE(false)
+#define SPINLOCK_TICKET_INITIALIZER	SPINLOCK_INITIALIZER_MODE(true)
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_ticket	Initialize the contents of a spinlock as a ticket lock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * track	Give the lock a name and add it to the list printed by
+ *		spinlock_printstats. Meant for long-lived global locks;
+ *		a tracked lock must never be cleaned up.
+ * printstats	Print the contention counters of all tracked locks.
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_ticket(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
@@ -91,5 +129,8 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_track(struct spinlock *lk, const char *name);
+void spinlock_printstats(void);
+
 
 #endif /* _SPINLOCK_H_ */
@@ -36,6 +36,12 @@
 
 
 #include <spinlock.h>
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+#include <kern/time.h>
+struct lockstat;	/* Private to synch.c */
+#endif
 
 /*
  * Dijkstra-style semaphore.
@@ -71,13 +77,26 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * The lock is adaptive: lk_busy is claimed with an atomic
+ * test-and-set, so an uncontended acquire or release never touches
+ * lk_lock. A contended acquire spins for a while if the holder is
+ * running on another cpu and otherwise sleeps on lk_wchan. lk_lock
+ * protects the wait channel and lk_nwaiting, which tells the releaser
+ * whether anyone needs waking.
  */
 struct lock {
         char *lk_name;
         HANGMAN_LOCKABLE(lk_hangman);   /* Deadlock detector hook. */
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
+        volatile spinlock_data_t lk_busy;       /* 1 while held */
+        volatile unsigned lk_nwaiting;  /* Threads in the slow path */
         struct thread *volatile lk_holder;
+#if OPT_LOCKSTAT
+        struct lockstat *lk_stat;       /* Profile entry for lk_name */
+        struct timespec lk_holdstart;   /* When the holder got it */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -98,6 +117,23 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+#if OPT_LOCKSTAT
+/*
+ * Lock profiling (options lockstat). Counters are kept per lock name,
+ * so e.g. all the "pidinfo exit" locks are lumped together. Nothing
+ * is recorded until profiling is switched on, because timing needs
+ * the realtime clock, which doesn't exist early in boot.
+ *
+ *    lockstat_enable     - Start (true) or stop (false) profiling.
+ *    lockstat_reset      - Zero all counters.
+ *    lockstat_printstats - Print the counters for every lock name
+ *                          that has been acquired.
+ */
+void lockstat_enable(bool on);
+void lockstat_reset(void);
+void lockstat_printstats(void);
+#endif
+
 
 /*
  * Condition variable.
@@ -140,4 +176,53 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * The lock is writer-preferring: once a writer is waiting, new
+ * readers wait behind it, so a stream of readers cannot starve
+ * writers. This also means a thread must not take a read lock it
+ * already holds for read; if a writer arrives in between, that
+ * deadlocks.
+ *
+ * Waiting is done by sleeping. Readers who find the lock held by a
+ * writer that is running on another cpu spin for a while first (see
+ * RWLOCK_READSPIN in synch.c).
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+        char *rw_name;
+        struct wchan *rw_rwchan;        /* Readers sleep here */
+        struct wchan *rw_wwchan;        /* Writers sleep here */
+        struct spinlock rw_lock;        /* Protects the following */
+        volatile unsigned rw_readers;   /* Number of readers inside */
+        volatile unsigned rw_wwaiting;  /* Number of writers waiting */
+        struct thread *volatile rw_writer; /* Writer inside, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Waits while a
+ *                           writer holds the lock or is waiting for it.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing (exclusively).
+ *    rwlock_release_write - Give up a write hold.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing. (There is no
+ *                           equivalent for readers, as readers are
+ *                           not tracked individually.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -85,6 +85,27 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler fields.
+	 *
+	 * t_mlfq_level is the thread's current level in the multilevel
+	 * feedback queue; 0 is the highest priority. t_mlfq_used counts
+	 * hardclocks charged to the thread at that level, and
+	 * t_mlfq_waited counts schedule() passes spent waiting on a run
+	 * queue, for aging. All three are protected by the run queue
+	 * lock of t_cpu (or are private to the thread while it runs).
+	 *
+	 * t_nice is the Unix-style nice value (PRIO_MIN to PRIO_MAX)
+	 * copied from the thread's process; it biases both the run
+	 * queue position and the quantum length. It is only written
+	 * via proc_setnice() and takes effect the next time the thread
+	 * is queued.
+	 */
+	unsigned t_mlfq_level;		/* Feedback queue level */
+	unsigned t_mlfq_used;		/* Ticks used at this level */
+	unsigned t_mlfq_waited;		/* Aging counter while ready */
+	volatile int t_nice;		/* Nice value */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -163,6 +184,13 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for one timer tick, and preempt it if its
+ * time slice is used up or a higher-priority thread is waiting. Called
+ * from the timer interrupt.
+ */
+void thread_tick(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -47,6 +47,15 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * When searching, though, we can skip over full stretches of the map
+ * a uint32_t at a time: whether all 32 bits are set doesn't depend on
+ * byte order. (The data comes from kmalloc, so it's aligned.)
+ */
+#define WORDS_PER_CHUNK (sizeof(uint32_t) / sizeof(WORD_TYPE))
+#define BITS_PER_CHUNK  (WORDS_PER_CHUNK * BITS_PER_WORD)
+#define CHUNK_ALLBITS   (0xffffffff)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
@@ -95,40 +104,107 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
-int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+static
+inline
+void
+bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
         unsigned offset;
+        *ix = bitno / BITS_PER_WORD;
+        offset = bitno % BITS_PER_WORD;
+        *mask = ((WORD_TYPE)1) << offset;
+}
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+/*
+ * Return the index of the lowest clear bit in W, which must not be
+ * WORD_ALLBITS. ~w & (w+1) isolates that bit; then a binary search
+ * on masks turns it into an index without looping over the bits.
+ */
+static
+inline
+unsigned
+bitmap_firstzero(WORD_TYPE w)
+{
+        WORD_TYPE bit;
+
+        KASSERT(w != WORD_ALLBITS);
+        bit = ~w & (WORD_TYPE)(w + 1);
+        return ((bit & 0xf0) ? 4 : 0) |
+                ((bit & 0xcc) ? 2 : 0) |
+                ((bit & 0xaa) ? 1 : 0);
+}
+
+/*
+ * Find a clear bit with index in [FROM, TO).
+ */
+static
+int
+bitmap_findzero(struct bitmap *b, unsigned from, unsigned to,
+                unsigned *index)
+{
+        const uint32_t *chunks = (const uint32_t *)b->v;
+        unsigned ix, bitno;
+        WORD_TYPE w;
+
+        bitno = from;
+        while (bitno < to) {
+                ix = bitno / BITS_PER_WORD;
+
+                /* Skip a whole chunk at a time if it's full. */
+                if (bitno % BITS_PER_CHUNK == 0 &&
+                    bitno + BITS_PER_CHUNK <= to &&
+                    chunks[ix / WORDS_PER_CHUNK] == CHUNK_ALLBITS) {
+                        bitno += BITS_PER_CHUNK;
+                        continue;
+                }
+
+                /* Treat bits below FROM in the first word as set. */
+                w = b->v[ix];
+                w |= (WORD_TYPE)((1U << (bitno % BITS_PER_WORD)) - 1);
+                if (w != WORD_ALLBITS) {
+                        bitno = ix*BITS_PER_WORD + bitmap_firstzero(w);
+                        if (bitno >= to) {
+                                break;
                         }
-                        KASSERT(0);
+                        *index = bitno;
+                        return 0;
                 }
+                bitno = (ix + 1) * BITS_PER_WORD;
         }
         return ENOSPC;
 }
 
-static
-inline
-void
-bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
 {
-        unsigned offset;
-        *ix = bitno / BITS_PER_WORD;
-        offset = bitno % BITS_PER_WORD;
-        *mask = ((WORD_TYPE)1) << offset;
+        return bitmap_alloc_near(b, 0, index);
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned ix;
+        WORD_TYPE mask;
+        int result;
+
+        if (start >= b->nbits) {
+                start = 0;
+        }
+
+        /* Search from START to the end, then wrap around. */
+        result = bitmap_findzero(b, start, b->nbits, index);
+        if (result) {
+                result = bitmap_findzero(b, 0, start, index);
+                if (result) {
+                        return result;
+                }
+        }
+        KASSERT(*index < b->nbits);
+
+        bitmap_translate(*index, &ix, &mask);
+        KASSERT((b->v[ix] & mask)==0);
+        b->v[ix] |= mask;
+        return 0;
 }
 
 void
@@ -45,6 +45,8 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <device.h>
 #include <pid.h>
 #include <syscall.h>
@@ -109,6 +111,7 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	kheap_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	pid_bootstrap();
@@ -128,8 +131,11 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	buffer_bootstrap();
+	namecache_bootstrap();
 	kprintf_bootstrap();
 	exec_bootstrap();
+	futex_bootstrap();
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
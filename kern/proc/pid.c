@@ -42,6 +42,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <pid.h>
 
 /*
@@ -50,57 +51,106 @@
  * If pi_ppid is INVALID_PID, the parent has gone away and will not be
  * waiting. If pi_ppid is INVALID_PID and pi_exited is true, the
  * structure can be freed.
+ *
+ * pi_proc points to the process until it exits, and is cleared (under
+ * pidlock) before the proc structure is destroyed; so holding pidlock
+ * makes it safe to look at another live process.
+ *
+ * While a process has a parent, its pidinfo is on one of the
+ * parent's two child lists, pi_livekids or pi_deadkids, linked
+ * through pi_prevsib/pi_nextsib; exiting moves it from the first to
+ * the second. So waitpid for any child only has to look at the head
+ * of pi_deadkids, and exiting only touches the exiting process's
+ * own children.
+ *
+ * pi_wchan and pi_waitlock act as a condition variable on which the
+ * process waits for its children. (A real CV can't be used with
+ * pidlock, which is a reader-writer lock.) A child that exits wakes
+ * its parent's channel and nobody else's. All the list fields are
+ * protected by pidlock (held for writing).
  */
 struct pidinfo {
 	pid_t pi_pid;			// process id of this thread
 	pid_t pi_ppid;			// process id of parent thread
+	struct proc *pi_proc;		// process, or NULL once exited
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
-	struct cv *pi_cv;		// use to wait for thread exit
+	struct pidinfo *pi_parent;	// parent, or NULL if none
+	struct pidinfo *pi_prevsib;	// links on parent's child list
+	struct pidinfo *pi_nextsib;
+	struct pidinfo *pi_livekids;	// children still running
+	struct pidinfo *pi_deadkids;	// children exited, not waited for
+	unsigned pi_nkids;		// number of children on both lists
+	struct wchan *pi_wchan;		// use to wait for child exit
+	struct spinlock pi_waitlock;	// lock for pi_wchan
 };
 
 
 /*
  * Global pid and exit data.
  *
- * The process table is an el-cheapo hash table. It's indexed by
- * (pid % PROCS_MAX), and only allows one process per slot. If a
- * new pid allocation would cause a hash collision, we just don't
- * use that pid.
+ * The process table is a two-level radix table indexed directly by
+ * pid: pidtable[pid / PIDCHUNK_SIZE] points to a chunk of
+ * PIDCHUNK_SIZE slots, allocated the first time a pid in its range
+ * is handed out and never freed. So lookup is O(1), and a system with
+ * only a few processes pays for only a few chunks.
+ *
+ * Free pids are tracked in the bitmap pidmap, one bit per pid. New
+ * pids are taken from the first clear bit at or after nextpid, which
+ * then moves past it, so pids are not reused right after they're
+ * freed. The scan goes a word at a time, so it costs at most
+ * PIDMAP_WORDS steps even when the table is nearly full, and usually
+ * one.
+ *
+ * The number of live pids is limited to PROCS_MAX.
+ *
+ * pidlock is a reader-writer lock: lookups that only look at the
+ * table (e.g. getpriority) take it for reading, and anything that
+ * changes it takes it for writing. Memory is never allocated while
+ * holding it.
  */
-static struct lock *pidlock;		// lock for global exit data
-static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
+#define PIDCHUNK_SIZE	256
+#define PIDCHUNK_COUNT	((PID_MAX + PIDCHUNK_SIZE) / PIDCHUNK_SIZE)
+#define PIDMAP_WORDS	((PID_MAX + 32) / 32)
+
+static struct rwlock *pidlock;		// lock for global exit data
+static struct pidinfo **pidtable[PIDCHUNK_COUNT]; // actual pid info
+static uint32_t pidmap[PIDMAP_WORDS];	// bitmap of pids in use
 static pid_t nextpid;			// next candidate pid
 static int nprocs;			// number of allocated pids
 
 
 
 /*
- * Create a pidinfo structure for the specified pid.
+ * Create a pidinfo structure. The pid is assigned later, by pi_put.
  */
 static
 struct pidinfo *
-pidinfo_create(pid_t pid, pid_t ppid)
+pidinfo_create(pid_t ppid)
 {
 	struct pidinfo *pi;
 
-	KASSERT(pid != INVALID_PID);
-
 	pi = kmalloc(sizeof(struct pidinfo));
 	if (pi==NULL) {
 		return NULL;
 	}
 
-	pi->pi_cv = cv_create("pidinfo cv");
-	if (pi->pi_cv == NULL) {
+	pi->pi_wchan = wchan_create("pidinfo");
+	if (pi->pi_wchan == NULL) {
 		kfree(pi);
 		return NULL;
 	}
+	spinlock_init(&pi->pi_waitlock);
 
-	pi->pi_pid = pid;
+	pi->pi_pid = INVALID_PID;
 	pi->pi_ppid = ppid;
+	pi->pi_proc = NULL;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	pi->pi_parent = NULL;
+	pi->pi_prevsib = pi->pi_nextsib = NULL;
+	pi->pi_livekids = pi->pi_deadkids = NULL;
+	pi->pi_nkids = 0;
 
 	return pi;
 }
@@ -114,10 +164,147 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
+	KASSERT(pi->pi_parent == NULL);
+	KASSERT(pi->pi_livekids == NULL && pi->pi_deadkids == NULL);
+	spinlock_cleanup(&pi->pi_waitlock);
+	wchan_destroy(pi->pi_wchan);
 	kfree(pi);
 }
 
+/*
+ * Add KID at the head of the child list *LIST.
+ */
+static
+void
+pidinfo_linkkid(struct pidinfo **list, struct pidinfo *kid)
+{
+	KASSERT(kid->pi_prevsib == NULL && kid->pi_nextsib == NULL);
+
+	kid->pi_nextsib = *list;
+	if (*list != NULL) {
+		(*list)->pi_prevsib = kid;
+	}
+	*list = kid;
+}
+
+/*
+ * Remove KID from the child list *LIST.
+ */
+static
+void
+pidinfo_unlinkkid(struct pidinfo **list, struct pidinfo *kid)
+{
+	if (kid->pi_prevsib != NULL) {
+		kid->pi_prevsib->pi_nextsib = kid->pi_nextsib;
+	}
+	else {
+		KASSERT(*list == kid);
+		*list = kid->pi_nextsib;
+	}
+	if (kid->pi_nextsib != NULL) {
+		kid->pi_nextsib->pi_prevsib = kid->pi_prevsib;
+	}
+	kid->pi_prevsib = kid->pi_nextsib = NULL;
+}
+
+/*
+ * Allocate an empty chunk of the process table.
+ */
+static
+struct pidinfo **
+pidchunk_create(void)
+{
+	struct pidinfo **chunk;
+	unsigned i;
+
+	chunk = kmalloc(PIDCHUNK_SIZE * sizeof(struct pidinfo *));
+	if (chunk == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PIDCHUNK_SIZE; i++) {
+		chunk[i] = NULL;
+	}
+	return chunk;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Bitmap helpers.
+ */
+static
+bool
+pidmap_isset(pid_t pid)
+{
+	return (pidmap[pid / 32] & ((uint32_t)1 << (pid % 32))) != 0;
+}
+
+static
+void
+pidmap_mark(pid_t pid)
+{
+	KASSERT(!pidmap_isset(pid));
+	pidmap[pid / 32] |= (uint32_t)1 << (pid % 32);
+}
+
+static
+void
+pidmap_unmark(pid_t pid)
+{
+	KASSERT(pidmap_isset(pid));
+	pidmap[pid / 32] &= ~((uint32_t)1 << (pid % 32));
+}
+
+/*
+ * Return the index of the lowest clear bit in W, which must not be
+ * all ones.
+ */
+static
+unsigned
+pidmap_ffz(uint32_t w)
+{
+	unsigned bit = 0;
+
+	KASSERT(w != 0xffffffff);
+	w = ~w;
+	if ((w & 0xffff) == 0) { w >>= 16; bit += 16; }
+	if ((w & 0xff) == 0) { w >>= 8; bit += 8; }
+	if ((w & 0xf) == 0) { w >>= 4; bit += 4; }
+	if ((w & 0x3) == 0) { w >>= 2; bit += 2; }
+	if ((w & 0x1) == 0) { bit += 1; }
+	return bit;
+}
+
+/*
+ * Find a free pid, starting at nextpid and wrapping around. There
+ * must be one.
+ */
+static
+pid_t
+pidmap_findfree(void)
+{
+	unsigned word, i;
+	uint32_t w;
+
+	KASSERT(rwlock_do_i_hold_write(pidlock));
+
+	word = nextpid / 32;
+	/* treat the bits below nextpid in the first word as in use */
+	w = pidmap[word] | (((uint32_t)1 << (nextpid % 32)) - 1);
+
+	for (i=0; i<=PIDMAP_WORDS; i++) {
+		if (w != 0xffffffff) {
+			return word * 32 + pidmap_ffz(w);
+		}
+		word++;
+		if (word == PIDMAP_WORDS) {
+			word = 0;
+		}
+		w = pidmap[word];
+	}
+	panic("pid_alloc: no free pids, but nprocs is %d\n", nprocs);
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -126,64 +313,81 @@ pidinfo_destroy(struct pidinfo *pi)
 void
 pid_bootstrap(void)
 {
-	int i;
+	struct pidinfo *pi;
+	pid_t pid;
 
-	pidlock = lock_create("pidlock");
+	pidlock = rwlock_create("pidlock");
 	if (pidlock == NULL) {
 		panic("Out of memory creating pid lock\n");
 	}
 
-	/* not really necessary - should start zeroed */
-	for (i=0; i<PROCS_MAX; i++) {
-		pidinfo[i] = NULL;
+	/*
+	 * Pids below PID_MIN and any bits past PID_MAX in the last
+	 * word of the map are never handed out.
+	 */
+	for (pid=0; pid<PID_MIN; pid++) {
+		pidmap_mark(pid);
+	}
+	for (pid=PID_MAX+1; pid<PIDMAP_WORDS*32; pid++) {
+		pidmap_mark(pid);
 	}
 
-	pidinfo[KERNEL_PID] = pidinfo_create(KERNEL_PID, INVALID_PID);
-	if (pidinfo[KERNEL_PID]==NULL) {
+	pidtable[0] = pidchunk_create();
+	pi = pidinfo_create(INVALID_PID);
+	if (pidtable[0] == NULL || pi == NULL) {
 		panic("Out of memory creating kernel pid data\n");
 	}
+	pi->pi_pid = KERNEL_PID;
+	pidtable[0][KERNEL_PID] = pi;
 
 	nextpid = PID_MIN;
 	nprocs = 1;
 }
 
 /*
- * pi_get: look up a pidinfo in the process table.
+ * pi_get: look up a pidinfo in the process table. pidlock must be
+ * held, for reading or writing.
  */
 static
 struct pidinfo *
 pi_get(pid_t pid)
 {
-	struct pidinfo *pi;
+	struct pidinfo **chunk;
 
 	KASSERT(pid>=0);
 	KASSERT(pid != INVALID_PID);
-	KASSERT(lock_do_i_hold(pidlock));
 
-	pi = pidinfo[pid % PROCS_MAX];
-	if (pi==NULL) {
+	if (pid > PID_MAX) {
 		return NULL;
 	}
-	if (pi->pi_pid != pid) {
+	chunk = pidtable[pid / PIDCHUNK_SIZE];
+	if (chunk == NULL) {
 		return NULL;
 	}
-	return pi;
+	return chunk[pid % PIDCHUNK_SIZE];
 }
 
 /*
- * pi_put: insert a new pidinfo in the process table. The right slot
- * must be empty.
+ * pi_put: insert a new pidinfo in the process table under pid PID,
+ * which must be free and whose chunk must exist.
  */
 static
 void
 pi_put(pid_t pid, struct pidinfo *pi)
 {
-	KASSERT(lock_do_i_hold(pidlock));
+	struct pidinfo **chunk;
 
-	KASSERT(pid != INVALID_PID);
+	KASSERT(rwlock_do_i_hold_write(pidlock));
 
-	KASSERT(pidinfo[pid % PROCS_MAX] == NULL);
-	pidinfo[pid % PROCS_MAX] = pi;
+	KASSERT(pid >= PID_MIN && pid <= PID_MAX);
+
+	chunk = pidtable[pid / PIDCHUNK_SIZE];
+	KASSERT(chunk != NULL);
+	KASSERT(chunk[pid % PIDCHUNK_SIZE] == NULL);
+
+	pidmap_mark(pid);
+	pi->pi_pid = pid;
+	chunk[pid % PIDCHUNK_SIZE] = pi;
 	nprocs++;
 }
 
@@ -198,82 +402,128 @@ pi_drop(pid_t pid)
 {
 	struct pidinfo *pi;
 
-	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(rwlock_do_i_hold_write(pidlock));
 
-	pi = pidinfo[pid % PROCS_MAX];
+	pi = pi_get(pid);
 	KASSERT(pi != NULL);
 	KASSERT(pi->pi_pid == pid);
 
 	pidinfo_destroy(pi);
-	pidinfo[pid % PROCS_MAX] = NULL;
+	pidtable[pid / PIDCHUNK_SIZE][pid % PIDCHUNK_SIZE] = NULL;
+	pidmap_unmark(pid);
 	nprocs--;
 }
 
-////////////////////////////////////////////////////////////
-
 /*
- * Helper function for pid_alloc.
+ * Detach KID from its parent, e.g. because the parent is exiting or
+ * has disowned it. If KID has already exited, nobody needs its
+ * pidinfo any more and it is dropped.
  */
 static
 void
-inc_nextpid(void)
+pidinfo_orphan(struct pidinfo *kid)
 {
-	KASSERT(lock_do_i_hold(pidlock));
+	struct pidinfo *parent = kid->pi_parent;
 
-	nextpid++;
-	if (nextpid > PID_MAX) {
-		nextpid = PID_MIN;
+	KASSERT(parent != NULL);
+	if (kid->pi_exited) {
+		pidinfo_unlinkkid(&parent->pi_deadkids, kid);
+	}
+	else {
+		pidinfo_unlinkkid(&parent->pi_livekids, kid);
+	}
+	KASSERT(parent->pi_nkids > 0);
+	parent->pi_nkids--;
+	kid->pi_parent = NULL;
+	kid->pi_ppid = INVALID_PID;
+	if (kid->pi_exited) {
+		pi_drop(kid->pi_pid);
 	}
 }
 
+////////////////////////////////////////////////////////////
+
 /*
- * pid_alloc: allocate a process id.
+ * pid_alloc: allocate a process id for the new process PROC.
+ *
+ * The pidinfo, and if needed a new table chunk, are allocated before
+ * taking pidlock. A chunk we turn out not to need is freed again.
  */
 int
-pid_alloc(pid_t *retval)
+pid_alloc(struct proc *proc, pid_t *retval)
 {
-	struct pidinfo *pi;
+	struct pidinfo *pi, *us;
+	struct pidinfo **newchunk;
+	rlim_t kidlimit;
 	pid_t pid;
-	int count;
 
 	KASSERT(curproc->p_pid != INVALID_PID);
 
-	/* lock the table */
-	lock_acquire(pidlock);
+	/* RLIMIT_NPROC limits the number of children we may have */
+	kidlimit = proc_getlimit(curproc, RLIMIT_NPROC);
 
-	if (nprocs == PROCS_MAX) {
-		lock_release(pidlock);
-		return EAGAIN;
+	pi = pidinfo_create(curproc->p_pid);
+	if (pi==NULL) {
+		return ENOMEM;
 	}
+	pi->pi_proc = proc;
+	newchunk = NULL;
 
-	/*
-	 * The above test guarantees that this loop terminates, unless
-	 * our nprocs count is off. Even so, assert we aren't looping
-	 * forever.
-	 */
-	count = 0;
-	while (pidinfo[nextpid % PROCS_MAX] != NULL) {
+	/* lock the table */
+	rwlock_acquire_write(pidlock);
 
-		/* avoid various boundary cases by allowing extra loops */
-		KASSERT(count < PROCS_MAX*2+5);
-		count++;
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
 
-		inc_nextpid();
-	}
+	while (1) {
+		if (nprocs >= PROCS_MAX || us->pi_nkids >= kidlimit) {
+			rwlock_release_write(pidlock);
+			pi->pi_exited = true;
+			pi->pi_ppid = INVALID_PID;
+			pidinfo_destroy(pi);
+			if (newchunk != NULL) {
+				kfree(newchunk);
+			}
+			return EAGAIN;
+		}
 
-	pid = nextpid;
+		pid = pidmap_findfree();
+		if (pidtable[pid / PIDCHUNK_SIZE] != NULL) {
+			break;
+		}
+		if (newchunk != NULL) {
+			pidtable[pid / PIDCHUNK_SIZE] = newchunk;
+			newchunk = NULL;
+			break;
+		}
 
-	pi = pidinfo_create(pid, curproc->p_pid);
-	if (pi==NULL) {
-		lock_release(pidlock);
-		return ENOMEM;
+		/* Get a chunk without the lock, then look again */
+		rwlock_release_write(pidlock);
+		newchunk = pidchunk_create();
+		if (newchunk == NULL) {
+			pi->pi_exited = true;
+			pi->pi_ppid = INVALID_PID;
+			pidinfo_destroy(pi);
+			return ENOMEM;
+		}
+		rwlock_acquire_write(pidlock);
 	}
 
 	pi_put(pid, pi);
+	pi->pi_parent = us;
+	pidinfo_linkkid(&us->pi_livekids, pi);
+	us->pi_nkids++;
 
-	inc_nextpid();
+	nextpid = pid + 1;
+	if (nextpid > PID_MAX) {
+		nextpid = PID_MIN;
+	}
 
-	lock_release(pidlock);
+	rwlock_release_write(pidlock);
+
+	if (newchunk != NULL) {
+		kfree(newchunk);
+	}
 
 	*retval = pid;
 	return 0;
@@ -290,7 +540,7 @@ pid_unalloc(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
+	rwlock_acquire_write(pidlock);
 
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
@@ -299,12 +549,15 @@ pid_unalloc(pid_t theirpid)
 
 	/* keep pidinfo_destroy from complaining */
 	them->pi_exitstatus = 0xdead;
+	pidinfo_unlinkkid(&them->pi_parent->pi_livekids, them);
+	them->pi_parent->pi_nkids--;
+	them->pi_parent = NULL;
 	them->pi_exited = true;
 	them->pi_ppid = INVALID_PID;
 
 	pi_drop(theirpid);
 
-	lock_release(pidlock);
+	rwlock_release_write(pidlock);
 }
 
 /*
@@ -318,24 +571,22 @@ pid_disown(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
+	rwlock_acquire_write(pidlock);
 
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
 	KASSERT(them->pi_ppid==curproc->p_pid);
 
-	them->pi_ppid = INVALID_PID;
-	if (them->pi_exited) {
-		pi_drop(them->pi_pid);
-	}
+	pidinfo_orphan(them);
 
-	lock_release(pidlock);
+	rwlock_release_write(pidlock);
 }
 
 /*
  * pid_setexitstatus: Sets the exit status of this process. Must only
- * be called if the thread actually had a pid assigned. Wakes up any
- * waiters and disposes of the piddata if nobody else is still using it.
+ * be called if the thread actually had a pid assigned. Wakes up the
+ * parent if it's waiting and disposes of the piddata if nobody else
+ * is still using it.
  *
  * As far as the process is concerned, this releases its pid for
  * subsequent reuse; thus we set curproc->p_pid to INVALID_PID.
@@ -343,42 +594,43 @@ pid_disown(pid_t theirpid)
 void
 pid_setexitstatus(int status)
 {
-	struct pidinfo *us;
-	int i;
+	struct pidinfo *us, *parent;
 
-	lock_acquire(pidlock);
+	rwlock_acquire_write(pidlock);
 	KASSERT(curproc->p_pid != INVALID_PID);
 
-	/* First, disown all children */
-	for (i=0; i<PROCS_MAX; i++) {
-		if (pidinfo[i]==NULL) {
-			continue;
-		}
-		if (pidinfo[i]->pi_ppid == curproc->p_pid) {
-			pidinfo[i]->pi_ppid = INVALID_PID;
-			if (pidinfo[i]->pi_exited) {
-				pi_drop(pidinfo[i]->pi_pid);
-			}
-		}
-	}
-
-	/* Now, wake up our parent */
 	us = pi_get(curproc->p_pid);
 	KASSERT(us != NULL);
 
+	/* First, disown all children */
+	while (us->pi_livekids != NULL) {
+		pidinfo_orphan(us->pi_livekids);
+	}
+	while (us->pi_deadkids != NULL) {
+		pidinfo_orphan(us->pi_deadkids);
+	}
+
 	us->pi_exitstatus = status;
 	us->pi_exited = true;
+	us->pi_proc = NULL;
 
-	if (us->pi_ppid == INVALID_PID) {
+	parent = us->pi_parent;
+	if (parent == NULL) {
 		/* no parent */
+		KASSERT(us->pi_ppid == INVALID_PID);
 		pi_drop(curproc->p_pid);
 	}
 	else {
-		cv_broadcast(us->pi_cv, pidlock);
+		/* Now, move to the parent's exited list and wake it up */
+		pidinfo_unlinkkid(&parent->pi_livekids, us);
+		pidinfo_linkkid(&parent->pi_deadkids, us);
+		spinlock_acquire(&parent->pi_waitlock);
+		wchan_wakeall(parent->pi_wchan, &parent->pi_waitlock);
+		spinlock_release(&parent->pi_waitlock);
 	}
 
 	curproc->p_pid = INVALID_PID;
-	lock_release(pidlock);
+	rwlock_release_write(pidlock);
 }
 
 /*
@@ -386,13 +638,17 @@ pid_setexitstatus(int status)
  * status and ret are a kernel pointers, but pid/flags may come from
  * userland and may thus be maliciously invalid.
  *
+ * THEIRPID may be WAIT_ANY (-1) to wait for whichever child exits
+ * first. With WNOHANG, if no suitable child has exited yet, *ret is
+ * set to 0 and we return at once.
+ *
  * status may be null, in which case the status is thrown away. ret
  * may only be null if WNOHANG is not set.
  */
 int
 pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 {
-	struct pidinfo *them;
+	struct pidinfo *us, *them;
 
 	KASSERT(curproc->p_pid != INVALID_PID);
 
@@ -402,11 +658,12 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 	}
 
 	/*
-	 * We don't support the Unix meanings of negative pids or 0
-	 * (0 is INVALID_PID) and other code may break on them, so
-	 * check now.
+	 * We don't support process groups, so 0 (which is also
+	 * INVALID_PID) and other negative pids are not supported and
+	 * other code may break on them; check now.
 	 */
-	if (theirpid == INVALID_PID || theirpid<0) {
+	if (theirpid == INVALID_PID ||
+	    (theirpid < 0 && theirpid != WAIT_ANY)) {
 		return ENOSYS;
 	}
 
@@ -415,51 +672,112 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		return EINVAL;
 	}
 
-	lock_acquire(pidlock);
+	rwlock_acquire_write(pidlock);
 
-	them = pi_get(theirpid);
-	if (them==NULL) {
-		lock_release(pidlock);
-		return ESRCH;
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+
+	if (theirpid == WAIT_ANY) {
+		them = NULL;
+		if (us->pi_livekids == NULL && us->pi_deadkids == NULL) {
+			rwlock_release_write(pidlock);
+			return ECHILD;
+		}
 	}
+	else {
+		them = pi_get(theirpid);
+		if (them==NULL) {
+			rwlock_release_write(pidlock);
+			return ESRCH;
+		}
 
-	KASSERT(them->pi_pid==theirpid);
+		KASSERT(them->pi_pid==theirpid);
 
-	/* Only allow waiting for own children. */
-	if (them->pi_ppid != curproc->p_pid) {
-		lock_release(pidlock);
-		return EPERM;
+		/* Only allow waiting for own children. */
+		if (them->pi_ppid != curproc->p_pid) {
+			rwlock_release_write(pidlock);
+			return EPERM;
+		}
 	}
 
-	if (them->pi_exited == false) {
+	while (1) {
+		if (them == NULL && us->pi_deadkids != NULL) {
+			them = us->pi_deadkids;
+			break;
+		}
+		if (them != NULL && them->pi_exited) {
+			break;
+		}
 		if (flags == WNOHANG) {
-			lock_release(pidlock);
+			rwlock_release_write(pidlock);
 			KASSERT(ret != NULL);
 			*ret = 0;
 			return 0;
 		}
-		/* don't need to loop on this */
-		cv_wait(them->pi_cv, pidlock);
-		KASSERT(them->pi_exited == true);
+		/*
+		 * Sleep without the lock. Take the wait channel's
+		 * spinlock first so a child exiting right after we
+		 * let go of pidlock can't wake us before we're asleep.
+		 * We're the parent, so nobody else can drop any of
+		 * our children meanwhile.
+		 */
+		spinlock_acquire(&us->pi_waitlock);
+		rwlock_release_write(pidlock);
+		wchan_sleep(us->pi_wchan, &us->pi_waitlock);
+		spinlock_release(&us->pi_waitlock);
+		rwlock_acquire_write(pidlock);
 	}
 
+	KASSERT(them->pi_exited == true);
+	KASSERT(them->pi_parent == us);
+
 	if (status != NULL) {
 		*status = them->pi_exitstatus;
 	}
 	if (ret != NULL) {
-		/*
-		 * In Unix you can wait for any of several possible
-		 * processes by passing particular magic values of
-		 * pid. wait then returns the pid you actually
-		 * found. We don't support this, so always return the
-		 * pid we looked for.
-		 */
-		*ret = theirpid;
+		*ret = them->pi_pid;
 	}
 
-	them->pi_ppid = 0;
-	pi_drop(them->pi_pid);
+	pidinfo_orphan(them);
+
+	rwlock_release_write(pidlock);
+	return 0;
+}
 
-	lock_release(pidlock);
+/*
+ * pid_getnice/pid_setnice: get or set the nice value of a live
+ * process. The process is found through pi_proc; holding pidlock
+ * (for reading is enough) keeps it from exiting and being destroyed
+ * while we look.
+ */
+int
+pid_getnice(pid_t pid, int *ret)
+{
+	struct pidinfo *pi;
+
+	rwlock_acquire_read(pidlock);
+	pi = pi_get(pid);
+	if (pi == NULL || pi->pi_proc == NULL) {
+		rwlock_release_read(pidlock);
+		return ESRCH;
+	}
+	*ret = proc_getnice(pi->pi_proc);
+	rwlock_release_read(pidlock);
+	return 0;
+}
+
+int
+pid_setnice(pid_t pid, int nice)
+{
+	struct pidinfo *pi;
+
+	rwlock_acquire_read(pidlock);
+	pi = pi_get(pid);
+	if (pi == NULL || pi->pi_proc == NULL) {
+		rwlock_release_read(pidlock);
+		return ESRCH;
+	}
+	proc_setnice(pi->pi_proc, nice);
+	rwlock_release_read(pidlock);
 	return 0;
 }
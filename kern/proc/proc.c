@@ -44,6 +44,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <limits.h>
 #include <spl.h>
 #include <synch.h>
 #include <proc.h>
@@ -58,6 +59,26 @@
  */
 struct proc *kproc;
 
+/*
+ * Set the default resource limits. Everything is unlimited except
+ * what has a fixed ceiling elsewhere in the system.
+ */
+static
+void
+proc_rlimit_init(struct proc *proc)
+{
+	unsigned i;
+
+	for (i=0; i<__RLIMIT_NUM; i++) {
+		proc->p_rlimits[i].rlim_cur = RLIM_INFINITY;
+		proc->p_rlimits[i].rlim_max = RLIM_INFINITY;
+	}
+	proc->p_rlimits[RLIMIT_NOFILE].rlim_cur = OPEN_MAX;
+	proc->p_rlimits[RLIMIT_NOFILE].rlim_max = OPEN_MAX;
+	proc->p_rlimits[RLIMIT_NPROC].rlim_cur = PROCS_MAX;
+	proc->p_rlimits[RLIMIT_NPROC].rlim_max = PROCS_MAX;
+}
+
 /*
  * Create a proc structure.
  */
@@ -88,6 +109,12 @@ proc_create(const char *name)
 	spinlock_init(&proc->p_lock);
 	proc->p_pid = INVALID_PID;
 
+	/* Scheduling fields */
+	proc->p_nice = 0;
+
+	/* Resource limits */
+	proc_rlimit_init(proc);
+
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
@@ -224,7 +251,7 @@ proc_create_runprogram(const char *name, struct proc **ret)
 		return ENOMEM;
 	}
 	/* Get a process ID */
-	result = pid_alloc(&newproc->p_pid);
+	result = pid_alloc(newproc, &newproc->p_pid);
 	if (result) {
 		proc_destroy(newproc);
 		return result;
@@ -246,6 +273,8 @@ proc_create_runprogram(const char *name, struct proc **ret)
 		VOP_INCREF(curproc->p_cwd);
 		newproc->p_cwd = curproc->p_cwd;
 	}
+	memcpy(newproc->p_rlimits, curproc->p_rlimits,
+	       sizeof(newproc->p_rlimits));
 	spinlock_release(&curproc->p_lock);
 
 	*ret = newproc;
@@ -275,7 +304,7 @@ proc_fork(struct proc **ret)
 		return ENOMEM;
 	}
 	/* Get a process ID */
-	result = pid_alloc(&newproc->p_pid);
+	result = pid_alloc(newproc, &newproc->p_pid);
 	if (result) {
 		proc_destroy(newproc);
 		return result;
@@ -318,15 +347,18 @@ proc_fork(struct proc **ret)
 	}
 
 	/*
-	 * Lock the current process to copy its current directory.
-	 * (We don't need to lock the new process, though, as we have
-	 * the only reference to it.)
+	 * Lock the current process to copy its current directory,
+	 * nice value, and limits. (We don't need to lock the new
+	 * process, though, as we have the only reference to it.)
 	 */
 	spinlock_acquire(&curproc->p_lock);
 	if (curproc->p_cwd != NULL) {
 		VOP_INCREF(curproc->p_cwd);
 		newproc->p_cwd = curproc->p_cwd;
 	}
+	newproc->p_nice = curproc->p_nice;
+	memcpy(newproc->p_rlimits, curproc->p_rlimits,
+	       sizeof(newproc->p_rlimits));
 	spinlock_release(&curproc->p_lock);
 
 	*ret = newproc;
@@ -484,3 +516,98 @@ proc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+/*
+ * Get the nice value of a process.
+ */
+int
+proc_getnice(struct proc *proc)
+{
+	int nice;
+
+	spinlock_acquire(&proc->p_lock);
+	nice = proc->p_nice;
+	spinlock_release(&proc->p_lock);
+	return nice;
+}
+
+/*
+ * Set the nice value of a process and of each of its threads. The
+ * scheduler picks up the new value the next time each thread is
+ * queued.
+ */
+void
+proc_setnice(struct proc *proc, int nice)
+{
+	unsigned num, i;
+
+	lock_acquire(proc->p_threadslock);
+
+	spinlock_acquire(&proc->p_lock);
+	proc->p_nice = nice;
+	spinlock_release(&proc->p_lock);
+
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		threadarray_get(&proc->p_threads, i)->t_nice = nice;
+	}
+
+	lock_release(proc->p_threadslock);
+}
+
+/*
+ * Get the soft limit for resource WHICH.
+ */
+rlim_t
+proc_getlimit(struct proc *proc, int which)
+{
+	rlim_t ret;
+
+	KASSERT(which >= 0 && which < __RLIMIT_NUM);
+
+	spinlock_acquire(&proc->p_lock);
+	ret = proc->p_rlimits[which].rlim_cur;
+	spinlock_release(&proc->p_lock);
+	return ret;
+}
+
+/*
+ * Get both limits for resource WHICH.
+ */
+void
+proc_getrlimit(struct proc *proc, int which, struct rlimit *ret)
+{
+	KASSERT(which >= 0 && which < __RLIMIT_NUM);
+
+	spinlock_acquire(&proc->p_lock);
+	*ret = proc->p_rlimits[which];
+	spinlock_release(&proc->p_lock);
+}
+
+/*
+ * Set the limits for resource WHICH. There are no privileged users,
+ * so nobody may raise a hard limit. The file table caches its limit;
+ * update that too.
+ */
+int
+proc_setrlimit(struct proc *proc, int which, const struct rlimit *rl)
+{
+	KASSERT(which >= 0 && which < __RLIMIT_NUM);
+
+	if (rl->rlim_cur > rl->rlim_max) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	if (rl->rlim_max > proc->p_rlimits[which].rlim_max) {
+		spinlock_release(&proc->p_lock);
+		return EPERM;
+	}
+	proc->p_rlimits[which] = *rl;
+	spinlock_release(&proc->p_lock);
+
+	if (which == RLIMIT_NOFILE && proc->p_filetable != NULL) {
+		filetable_setlimit(proc->p_filetable, rl->rlim_cur);
+	}
+	return 0;
+}
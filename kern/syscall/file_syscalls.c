@@ -105,14 +105,17 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 }
 
 /*
- * Common logic for read and write.
+ * Common logic for read, write, pread, and pwrite.
  *
- * Look up the fd, then use VOP_READ or VOP_WRITE.
+ * Look up the fd, then use VOP_READ or VOP_WRITE. If POSP is not
+ * NULL, this is pread/pwrite: do the I/O at *POSP and leave the
+ * file's seek position (and of_offsetlock) alone, so positional I/O
+ * on a shared openfile doesn't serialize on the offset lock.
  */
 static
 int
 sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
-	      int badaccmode, ssize_t *retval)
+	      int badaccmode, const off_t *posp, ssize_t *retval)
 {
 	struct openfile *file;
 	bool locked;
@@ -128,8 +131,19 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	}
 
 	/* Only lock the seek position if we're really using it. */
-	locked = VOP_ISSEEKABLE(file->of_vnode);
-	if (locked) {
+	if (posp != NULL) {
+		locked = false;
+		if (!VOP_ISSEEKABLE(file->of_vnode)) {
+			result = ESPIPE;
+			goto fail;
+		}
+		if (*posp < 0) {
+			result = EINVAL;
+			goto fail;
+		}
+		pos = *posp;
+	}
+	else if ((locked = VOP_ISSEEKABLE(file->of_vnode))) {
 		lock_acquire(file->of_offsetlock);
 		pos = file->of_offset;
 	}
@@ -183,7 +197,7 @@ fail:
 int
 sys_read(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_READ, O_WRONLY, retval);
+	return sys_readwrite(fd, buf, size, UIO_READ, O_WRONLY, NULL, retval);
 }
 
 /*
@@ -192,7 +206,26 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 int
 sys_write(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_WRITE, O_RDONLY, retval);
+	return sys_readwrite(fd, buf, size, UIO_WRITE, O_RDONLY, NULL, retval);
+}
+
+/*
+ * pread() - use sys_readwrite with an explicit position
+ */
+int
+sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+	return sys_readwrite(fd, buf, size, UIO_READ, O_WRONLY, &pos, retval);
+}
+
+/*
+ * pwrite() - use sys_readwrite with an explicit position
+ */
+int
+sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+	return sys_readwrite(fd, buf, size, UIO_WRITE, O_RDONLY, &pos,
+			     retval);
 }
 
 /*
@@ -300,7 +333,8 @@ sys_dup2(int oldfd, int newfd, int *retval)
 
 	ft = curproc->p_filetable;
 
-	if (!filetable_okfd(ft, newfd)) {
+	/* newfd must also be below RLIMIT_NOFILE */
+	if (!filetable_okfd(ft, newfd) || newfd >= ft->ft_limit) {
 		return EBADF;
 	}
 
@@ -316,6 +350,13 @@ sys_dup2(int oldfd, int newfd, int *retval)
 		return result;
 	}
 
+	/* make sure there's a slot for newfd */
+	result = filetable_grow(ft, newfd);
+	if (result) {
+		filetable_put(ft, oldfd, oldfdfile);
+		return result;
+	}
+
 	/* make another reference and return the fd */
 	openfile_incref(oldfdfile);
 	filetable_put(ft, oldfd, oldfdfile);
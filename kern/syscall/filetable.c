@@ -34,9 +34,59 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <bitmap.h>
 #include <openfile.h>
 #include <filetable.h>
 
+/*
+ * Tables start with room for FILETABLE_MINSIZE descriptors and double
+ * as needed, up to OPEN_MAX.
+ */
+#define FILETABLE_MINSIZE	16
+
+/*
+ * Allocate the slot array and bitmap for a table of SIZE slots, all
+ * empty. Does not free the old ones.
+ */
+static
+int
+filetable_alloc(struct filetable *ft, unsigned size)
+{
+	unsigned fd;
+
+	KASSERT(size <= OPEN_MAX);
+
+	ft->ft_openfiles = kmalloc(size * sizeof(struct openfile *));
+	if (ft->ft_openfiles == NULL) {
+		return ENOMEM;
+	}
+	ft->ft_inuse = bitmap_create(size);
+	if (ft->ft_inuse == NULL) {
+		kfree(ft->ft_openfiles);
+		return ENOMEM;
+	}
+	for (fd = 0; fd < size; fd++) {
+		ft->ft_openfiles[fd] = NULL;
+	}
+	ft->ft_size = size;
+	return 0;
+}
+
+/*
+ * Pick a table size that holds descriptors up to and including FD.
+ */
+static
+unsigned
+filetable_sizefor(int fd)
+{
+	unsigned size;
+
+	size = FILETABLE_MINSIZE;
+	while (size <= (unsigned)fd) {
+		size *= 2;
+	}
+	return size > OPEN_MAX ? OPEN_MAX : size;
+}
 
 /*
  * Construct a filetable.
@@ -45,7 +95,6 @@ struct filetable *
 filetable_create(void)
 {
 	struct filetable *ft;
-	int fd;
 
 	ft = kmalloc(sizeof(struct filetable));
 	if (ft == NULL) {
@@ -53,9 +102,12 @@ filetable_create(void)
 	}
 
 	/* the table starts empty */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		ft->ft_openfiles[fd] = NULL;
+	if (filetable_alloc(ft, FILETABLE_MINSIZE)) {
+		kfree(ft);
+		return NULL;
 	}
+	ft->ft_nopen = 0;
+	ft->ft_limit = OPEN_MAX;
 
 	return ft;
 }
@@ -66,20 +118,62 @@ filetable_create(void)
 void
 filetable_destroy(struct filetable *ft)
 {
-	int fd;
+	unsigned fd;
 
 	KASSERT(ft != NULL);
 
 	/* Close any open files. */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
+	for (fd = 0; ft->ft_nopen > 0; fd++) {
+		KASSERT(fd < ft->ft_size);
 		if (ft->ft_openfiles[fd] != NULL) {
 			openfile_decref(ft->ft_openfiles[fd]);
 			ft->ft_openfiles[fd] = NULL;
+			ft->ft_nopen--;
 		}
 	}
+	bitmap_destroy(ft->ft_inuse);
+	kfree(ft->ft_openfiles);
 	kfree(ft);
 }
 
+/*
+ * Make room in the table for descriptor FD. The table can only grow.
+ */
+int
+filetable_grow(struct filetable *ft, int fd)
+{
+	struct openfile **oldfiles;
+	struct bitmap *oldinuse;
+	unsigned oldsize, i;
+	int result;
+
+	KASSERT(filetable_okfd(ft, fd));
+
+	if ((unsigned)fd < ft->ft_size) {
+		return 0;
+	}
+
+	oldfiles = ft->ft_openfiles;
+	oldinuse = ft->ft_inuse;
+	oldsize = ft->ft_size;
+
+	result = filetable_alloc(ft, filetable_sizefor(fd));
+	if (result) {
+		ft->ft_openfiles = oldfiles;
+		ft->ft_inuse = oldinuse;
+		return result;
+	}
+	for (i = 0; i < oldsize; i++) {
+		if (oldfiles[i] != NULL) {
+			ft->ft_openfiles[i] = oldfiles[i];
+			bitmap_mark(ft->ft_inuse, i);
+		}
+	}
+	bitmap_destroy(oldinuse);
+	kfree(oldfiles);
+	return 0;
+}
+
 /*
  * Clone a filetable, for use in fork.
  *
@@ -94,13 +188,16 @@ filetable_destroy(struct filetable *ft)
  *
  * produce the intended output instead of having the second echo
  * command overwrite the first.
+ *
+ * The new table is only as big as it needs to be to hold the open
+ * descriptors, and we stop looking once we've seen them all.
  */
 int
 filetable_copy(struct filetable *src, struct filetable **dest_ret)
 {
 	struct filetable *dest;
 	struct openfile *file;
-	int fd;
+	unsigned fd, seen, maxfd;
 
 	/* Copying the nonexistent table avoids special cases elsewhere */
 	if (src == NULL) {
@@ -108,31 +205,47 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 		return 0;
 	}
 
-	dest = filetable_create();
+	/* find the highest open descriptor */
+	maxfd = 0;
+	for (fd = 0, seen = 0; seen < src->ft_nopen; fd++) {
+		if (src->ft_openfiles[fd] != NULL) {
+			maxfd = fd;
+			seen++;
+		}
+	}
+
+	dest = kmalloc(sizeof(struct filetable));
 	if (dest == NULL) {
 		return ENOMEM;
 	}
+	if (filetable_alloc(dest, filetable_sizefor(maxfd))) {
+		kfree(dest);
+		return ENOMEM;
+	}
 
 	/* share the entries */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
+	for (fd = 0; fd <= maxfd; fd++) {
 		file = src->ft_openfiles[fd];
 		if (file != NULL) {
 			openfile_incref(file);
+			dest->ft_openfiles[fd] = file;
+			bitmap_mark(dest->ft_inuse, fd);
 		}
-		dest->ft_openfiles[fd] = file;
 	}
+	dest->ft_nopen = src->ft_nopen;
+	dest->ft_limit = src->ft_limit;
 
 	*dest_ret = dest;
 	return 0;
 }
 
 /*
- * Check if a file handle is in range.
+ * Check if a file handle is in range. (It might still be beyond the
+ * end of the table as currently allocated.)
  */
 bool
 filetable_okfd(struct filetable *ft, int fd)
 {
-	/* We have a fixed-size table so we don't need to check the size */
 	(void)ft;
 
 	return (fd >= 0 && fd < OPEN_MAX);
@@ -151,7 +264,7 @@ filetable_get(struct filetable *ft, int fd, struct openfile **ret)
 {
 	struct openfile *file;
 
-	if (!filetable_okfd(ft, fd)) {
+	if (!filetable_okfd(ft, fd) || (unsigned)fd >= ft->ft_size) {
 		return EBADF;
 	}
 
@@ -194,28 +307,45 @@ filetable_put(struct filetable *ft, int fd, struct openfile *file)
  * the behavior had to be defined explicitly in order to allow
  * manipulating stdin/stdout/stderr.)
  *
+ * The in-use bitmap finds the smallest free slot; if there isn't
+ * one, the table grows and the first new slot is it. Only
+ * descriptors below the table's limit are used.
+ *
  * Consumes a reference to the openfile object. (That reference is
  * placed in the table.)
  */
 int
 filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
 {
-	int fd;
+	unsigned fd;
 
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		if (ft->ft_openfiles[fd] == NULL) {
-			ft->ft_openfiles[fd] = file;
-			*fd_ret = fd;
-			return 0;
+	if (bitmap_alloc(ft->ft_inuse, &fd)) {
+		fd = ft->ft_size;
+		if (fd >= (unsigned)ft->ft_limit || fd >= OPEN_MAX) {
+			return EMFILE;
 		}
+		if (filetable_grow(ft, fd)) {
+			return ENOMEM;
+		}
+		bitmap_mark(ft->ft_inuse, fd);
+	}
+	else if (fd >= (unsigned)ft->ft_limit) {
+		bitmap_unmark(ft->ft_inuse, fd);
+		return EMFILE;
 	}
 
-	return EMFILE;
+	KASSERT(ft->ft_openfiles[fd] == NULL);
+	ft->ft_openfiles[fd] = file;
+	ft->ft_nopen++;
+	*fd_ret = fd;
+	return 0;
 }
 
 /*
  * Place a file in a file table at a specific location and return the
- * file previously at that location. The location must be in range.
+ * file previously at that location. The location must be in range,
+ * and if NEWFILE isn't NULL, must be inside the table (see
+ * filetable_grow).
  *
  * Consumes a reference to the passed-in openfile object; returns a
  * reference to the old openfile object (if not NULL); this should
@@ -230,8 +360,35 @@ void
 filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
 		  struct openfile **oldfile_ret)
 {
+	struct openfile *oldfile;
+
 	KASSERT(filetable_okfd(ft, fd));
 
-	*oldfile_ret = ft->ft_openfiles[fd];
+	if ((unsigned)fd >= ft->ft_size) {
+		/* nothing is open out there */
+		KASSERT(newfile == NULL);
+		*oldfile_ret = NULL;
+		return;
+	}
+
+	oldfile = ft->ft_openfiles[fd];
+	if (oldfile == NULL && newfile != NULL) {
+		bitmap_mark(ft->ft_inuse, fd);
+		ft->ft_nopen++;
+	}
+	else if (oldfile != NULL && newfile == NULL) {
+		bitmap_unmark(ft->ft_inuse, fd);
+		ft->ft_nopen--;
+	}
 	ft->ft_openfiles[fd] = newfile;
+	*oldfile_ret = oldfile;
+}
+
+/*
+ * Set the limit on new descriptors. It can't go above OPEN_MAX.
+ */
+void
+filetable_setlimit(struct filetable *ft, rlim_t limit)
+{
+	ft->ft_limit = limit > OPEN_MAX ? OPEN_MAX : (int)limit;
 }
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Futexes: sleeping on a word of user memory.
+ *
+ * A futex is named by a user address together with the address space
+ * it's in, so threads sharing an address space can wait on any
+ * aligned int. The kernel keeps no state for a futex nobody is
+ * waiting on; the user-level fast path (see libc's sync.c) only
+ * calls in here when it has to sleep or wake someone.
+ *
+ * Waiters are kept in a small fixed hash table. Each bucket has a
+ * lock, a CV, and a list of waiter records, which live on the stacks
+ * of the waiting threads. Threads waiting on different futexes that
+ * hash to the same bucket share the CV, so waiters check their own
+ * record to see if they were really woken.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+struct futex_waiter {
+	struct addrspace *fw_as;	/* Address space of the futex */
+	vaddr_t fw_addr;		/* User address of the futex */
+	bool fw_woken;			/* Set by futex_wake */
+	struct futex_waiter *fw_next;	/* Next in bucket */
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;		/* Protects fb_waiters */
+	struct cv *fb_cv;		/* Waiters sleep here */
+	struct futex_waiter *fb_waiters; /* Waiters, oldest first */
+};
+
+#define FUTEX_HASHSIZE 31
+
+static struct futex_bucket futex_table[FUTEX_HASHSIZE];
+
+/*
+ * Setup function.
+ */
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		futex_table[i].fb_lock = lock_create("futex");
+		futex_table[i].fb_cv = cv_create("futex");
+		if (futex_table[i].fb_lock == NULL ||
+		    futex_table[i].fb_cv == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_getbucket(struct addrspace *as, vaddr_t addr)
+{
+	unsigned h;
+
+	h = ((uintptr_t)as >> 4) ^ (addr >> 2);
+	return &futex_table[h % FUTEX_HASHSIZE];
+}
+
+/*
+ * futex_wait: if the int at UADDR still contains VAL, sleep until a
+ * futex_wake on the same address. The check and the sleep are atomic
+ * with respect to futex_wake, so a wakeup can't be lost between the
+ * caller deciding to sleep and actually sleeping.
+ */
+int
+sys_futex_wait(userptr_t uaddr, int val)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter w, **wp;
+	int curval;
+	int result;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	w.fw_as = proc_getas();
+	w.fw_addr = (vaddr_t)uaddr;
+	w.fw_woken = false;
+	w.fw_next = NULL;
+
+	fb = futex_getbucket(w.fw_as, w.fw_addr);
+	lock_acquire(fb->fb_lock);
+
+	result = copyin(uaddr, &curval, sizeof(curval));
+	if (result) {
+		lock_release(fb->fb_lock);
+		return result;
+	}
+	if (curval != val) {
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+
+	/* Go on the end of the list, so wakeups are FIFO. */
+	for (wp = &fb->fb_waiters; *wp != NULL; wp = &(*wp)->fw_next);
+	*wp = &w;
+
+	while (!w.fw_woken) {
+		cv_wait(fb->fb_cv, fb->fb_lock);
+	}
+
+	lock_release(fb->fb_lock);
+	return 0;
+}
+
+/*
+ * futex_wake: wake up to COUNT threads waiting on the futex at UADDR.
+ * Hands back the number woken.
+ */
+int
+sys_futex_wake(userptr_t uaddr, int count, int *retval)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter *w, **wp;
+	struct addrspace *as;
+	vaddr_t addr;
+	int woken;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0 || count < 0) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	addr = (vaddr_t)uaddr;
+	fb = futex_getbucket(as, addr);
+
+	woken = 0;
+	lock_acquire(fb->fb_lock);
+	wp = &fb->fb_waiters;
+	while (*wp != NULL && woken < count) {
+		w = *wp;
+		if (w->fw_as == as && w->fw_addr == addr) {
+			*wp = w->fw_next;
+			w->fw_woken = true;
+			woken++;
+		}
+		else {
+			wp = &w->fw_next;
+		}
+	}
+	if (woken > 0) {
+		cv_broadcast(fb->fb_cv, fb->fb_lock);
+	}
+	lock_release(fb->fb_lock);
+
+	*retval = woken;
+	return 0;
+}
@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <lib.h>
 #include <machine/trapframe.h>
@@ -58,6 +60,93 @@ sys_getpid(pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_getpriority, sys_setpriority
+ *
+ * Only PRIO_PROCESS is supported, as there are no process groups or
+ * users. WHO is a pid; 0 means the current process. As in Unix,
+ * out-of-range nice values are clamped rather than rejected.
+ */
+int
+sys_getpriority(int which, pid_t who, int *retval)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who < 0) {
+		return ESRCH;
+	}
+	if (who == 0 || who == curproc->p_pid) {
+		*retval = proc_getnice(curproc);
+		return 0;
+	}
+	return pid_getnice(who, retval);
+}
+
+int
+sys_setpriority(int which, pid_t who, int prio)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who < 0) {
+		return ESRCH;
+	}
+
+	if (prio < PRIO_MIN) {
+		prio = PRIO_MIN;
+	}
+	if (prio > PRIO_MAX) {
+		prio = PRIO_MAX;
+	}
+
+	if (who == 0 || who == curproc->p_pid) {
+		proc_setnice(curproc, prio);
+		return 0;
+	}
+	return pid_setnice(who, prio);
+}
+
+/*
+ * sys_getrlimit, sys_setrlimit
+ *
+ * Only the limits the system enforces can be set; see proc.h.
+ */
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+	struct rlimit rl;
+
+	if (resource < 0 || resource >= __RLIMIT_NUM) {
+		return EINVAL;
+	}
+	proc_getrlimit(curproc, resource, &rl);
+	return copyout(&rl, rlp, sizeof(rl));
+}
+
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+	struct rlimit rl;
+	int result;
+
+	switch (resource) {
+	    case RLIMIT_AS:
+	    case RLIMIT_RSS:
+	    case RLIMIT_NOFILE:
+	    case RLIMIT_NPROC:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	result = copyin(rlp, &rl, sizeof(rl));
+	if (result) {
+		return result;
+	}
+	return proc_setrlimit(curproc, resource, &rl);
+}
+
 /*
  * sys__exit()
  *
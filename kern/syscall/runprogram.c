@@ -61,16 +61,27 @@ struct argbuf {
 	size_t len;
 	size_t max;
 	int nargs;
-	bool tooksem;
+	size_t reserved;	/* bytes charged to the exec budget */
 };
 
 /*
- * Throttle to limit the number of processes in exec at once. Or,
- * rather, the number trying to use large exec buffers at once. See
- * design notes for the rationale.
+ * Admission control for large exec buffers.
+ *
+ * Every exec gets a one-page argv buffer for free. One whose argv
+ * doesn't fit grows its buffer by doubling, up to ARG_MAX, and must
+ * first reserve the new size out of a global budget of
+ * EXEC_ARGBUF_BUDGET bytes. So several moderately large execs can
+ * proceed at once, while a burst of huge ones waits its turn instead
+ * of exhausting the kernel heap.
+ *
+ * Once anyone is waiting, newcomers wait behind them, so a stream
+ * of small reservations can't starve a large one.
  */
-#define EXEC_BIGBUF_THROTTLE	1
-static struct semaphore *execthrottle;
+#define EXEC_ARGBUF_BUDGET	(16 * ARG_MAX)
+static struct lock *exec_budgetlock;
+static struct cv *exec_budgetcv;
+static size_t exec_budgetused;
+static unsigned exec_budgetwaiters;
 
 /*
  * Set things up.
@@ -78,10 +89,55 @@ static struct semaphore *execthrottle;
 void
 exec_bootstrap(void)
 {
-	execthrottle = sem_create("exec", EXEC_BIGBUF_THROTTLE);
-	if (execthrottle == NULL) {
-		panic("Cannot create exec throttle semaphore\n");
+	exec_budgetlock = lock_create("exec budget");
+	if (exec_budgetlock == NULL) {
+		panic("Cannot create exec budget lock\n");
+	}
+	exec_budgetcv = cv_create("exec budget");
+	if (exec_budgetcv == NULL) {
+		panic("Cannot create exec budget cv\n");
+	}
+	exec_budgetused = 0;
+	exec_budgetwaiters = 0;
+}
+
+/*
+ * Reserve SIZE bytes of the exec budget, waiting if necessary.
+ */
+static
+void
+exec_budget_reserve(size_t size)
+{
+	bool mustwait;
+
+	KASSERT(size <= EXEC_ARGBUF_BUDGET);
+
+	lock_acquire(exec_budgetlock);
+	mustwait = exec_budgetwaiters > 0 ||
+		exec_budgetused + size > EXEC_ARGBUF_BUDGET;
+	if (mustwait) {
+		exec_budgetwaiters++;
+		do {
+			cv_wait(exec_budgetcv, exec_budgetlock);
+		} while (exec_budgetused + size > EXEC_ARGBUF_BUDGET);
+		exec_budgetwaiters--;
 	}
+	exec_budgetused += size;
+	lock_release(exec_budgetlock);
+}
+
+/*
+ * Give back SIZE bytes of the exec budget.
+ */
+static
+void
+exec_budget_release(size_t size)
+{
+	lock_acquire(exec_budgetlock);
+	KASSERT(exec_budgetused >= size);
+	exec_budgetused -= size;
+	cv_broadcast(exec_budgetcv, exec_budgetlock);
+	lock_release(exec_budgetlock);
 }
 
 /*
@@ -95,7 +151,7 @@ argbuf_init(struct argbuf *buf)
 	buf->len = 0;
 	buf->max = 0;
 	buf->nargs = 0;
-	buf->tooksem = false;
+	buf->reserved = 0;
 }
 
 /*
@@ -112,9 +168,9 @@ argbuf_cleanup(struct argbuf *buf)
 	buf->len = 0;
 	buf->max = 0;
 	buf->nargs = 0;
-	if (buf->tooksem) {
-		V(execthrottle);
-		buf->tooksem = false;
+	if (buf->reserved > 0) {
+		exec_budget_release(buf->reserved);
+		buf->reserved = 0;
 	}
 }
 
@@ -213,31 +269,38 @@ static
 int
 argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
 {
+	size_t size;
 	int result;
 
 	/* try with a small buffer */
-	result = argbuf_allocate(buf, PAGE_SIZE);
+	size = PAGE_SIZE;
+	result = argbuf_allocate(buf, size);
 	if (result) {
 		return result;
 	}
 
 	/* do the copyin */
 	result = argbuf_copyin(buf, uargv);
-	if (result == E2BIG) {
+	while (result == E2BIG && size < ARG_MAX) {
 		/*
-		 * Try again with the full-size buffer. Just start
-		 * over instead of trying to keep the page we already
+		 * Try again with a buffer twice the size. Just start
+		 * over instead of trying to keep what we already
 		 * did; this is a bit inefficient but it's not that
 		 * important.
 		 */
 		argbuf_cleanup(buf);
 		argbuf_init(buf);
 
-		/* Wait on the semaphore, to throttle this allocation */
-		P(execthrottle);
-		buf->tooksem = true;
+		size *= 2;
+		if (size > ARG_MAX) {
+			size = ARG_MAX;
+		}
+
+		/* Wait for room in the budget, to throttle this allocation */
+		exec_budget_reserve(size);
+		buf->reserved = size;
 
-		result = argbuf_allocate(buf, ARG_MAX);
+		result = argbuf_allocate(buf, size);
 		if (result) {
 			return result;
 		}
@@ -500,6 +563,8 @@ runprogram(char *progname)
 		if (curproc->p_filetable == NULL) {
 			return ENOMEM;
 		}
+		filetable_setlimit(curproc->p_filetable,
+			proc_getlimit(curproc, RLIMIT_NOFILE));
 
 		result = open_stdfds("con:", "con:", "con:");
 		if (result) {
@@ -40,6 +40,7 @@ bitmaptest(int nargs, char **args)
 	struct bitmap *b;
 	char data[TESTSIZE];
 	uint32_t x;
+	unsigned start, j;
 	int i;
 
 	(void)nargs;
@@ -101,6 +102,38 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/*
+	 * Free some bits again, and check that bitmap_alloc_near
+	 * finds the first free one at or after where it's told to
+	 * start, wrapping around.
+	 */
+	for (i=0; i<TESTSIZE; i++) {
+		if (random()%4 == 0) {
+			bitmap_unmark(b, i);
+			data[i] = 1;
+		}
+	}
+
+	while (1) {
+		start = random() % TESTSIZE;
+		if (bitmap_alloc_near(b, start, &x)) {
+			break;
+		}
+		for (j=start; data[j]==0; j = (j+1) % TESTSIZE) {
+			/* nothing */
+		}
+		KASSERT(x == j);
+		KASSERT(bitmap_isset(b, x));
+		data[x] = 0;
+	}
+
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i));
+		KASSERT(data[i]==0);
+	}
+
+	bitmap_destroy(b);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
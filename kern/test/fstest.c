@@ -42,6 +42,7 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <clock.h>
 #include <uio.h>
 #include <thread.h>
 #include <synch.h>
@@ -56,6 +57,7 @@
 #define NTHREADS 12
 #define NLONG    32
 #define NCREATE  24
+#define NSMALLIO 8
 
 static struct semaphore *threadsem = NULL;
 
@@ -674,6 +676,156 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Small-I/O benchmark. Like the write stress test, each thread
+ * writes its own file one line at a time, reads it back the same
+ * way, and removes it; but it does so NSMALLIO times, quietly, and
+ * the total time and throughput are reported at the end. Nearly all
+ * of the I/O is partial-block, so this measures how well that path
+ * runs from many threads at once.
+ */
+
+static unsigned long smallio_bytes;
+static struct spinlock smallio_lock = SPINLOCK_INITIALIZER;
+
+static
+int
+smallio_once(const char *fs, const char *namesuffix)
+{
+	struct vnode *vn;
+	char name[32];
+	char buf[32];
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	int i, err;
+
+	MAKENAME();
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for write: %s\n",
+			name, strerror(err));
+		return -1;
+	}
+	pos = 0;
+	for (i=0; i<NCHUNKS; i++) {
+		strcpy(buf, SLOGAN);
+		rotate(buf, i);
+		uio_kinit(&iov, &ku, buf, strlen(SLOGAN), pos, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("%s: Write error: %s\n", name,
+				err ? strerror(err) : "short write");
+			vfs_close(vn);
+			return -1;
+		}
+		pos = ku.uio_offset;
+	}
+	vfs_close(vn);
+
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for read: %s\n",
+			name, strerror(err));
+		return -1;
+	}
+	pos = 0;
+	for (i=0; i<NCHUNKS; i++) {
+		uio_kinit(&iov, &ku, buf, strlen(SLOGAN), pos, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("%s: Read error: %s\n", name,
+				err ? strerror(err) : "short read");
+			vfs_close(vn);
+			return -1;
+		}
+		buf[strlen(SLOGAN)] = 0;
+		rotate(buf, -i);
+		if (strcmp(buf, SLOGAN)) {
+			kprintf("%s: Test failed: line %d mismatched: %s\n",
+				name, i+1, buf);
+			vfs_close(vn);
+			return -1;
+		}
+		pos = ku.uio_offset;
+	}
+	vfs_close(vn);
+
+	if (fstest_remove(fs, namesuffix)) {
+		return -1;
+	}
+
+	spinlock_acquire(&smallio_lock);
+	smallio_bytes += 2 * pos;
+	spinlock_release(&smallio_lock);
+
+	return 0;
+}
+
+static
+void
+smallio_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	char numstr[16];
+	int i;
+
+	for (i=0; i<NSMALLIO; i++) {
+		snprintf(numstr, sizeof(numstr), "s%lu-%d", num, i);
+		if (smallio_once(filesys, numstr)) {
+			kprintf("*** Thread %lu: file %d: failed\n", num, i);
+			break;
+		}
+	}
+
+	V(threadsem);
+}
+
+static
+void
+dosmallio(const char *filesys)
+{
+	struct timespec before, after, duration;
+	unsigned long msecs;
+	int i, err;
+
+	init_threadsem();
+	smallio_bytes = 0;
+
+	kprintf("*** Starting fs small I/O benchmark on %s:\n", filesys);
+
+	gettime(&before);
+	for (i=0; i<NTHREADS; i++) {
+		err = thread_fork("smallio", NULL,
+				  smallio_thread, (char *)filesys, i);
+		if (err) {
+			panic("smallio: thread_fork failed %s\n",
+			      strerror(err));
+		}
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		P(threadsem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	msecs = duration.tv_sec * 1000 + duration.tv_nsec / 1000000;
+	kprintf("%lu bytes in %llu.%09lu seconds (%lu KB/s)\n",
+		smallio_bytes,
+		(unsigned long long) duration.tv_sec,
+		(unsigned long) duration.tv_nsec,
+		msecs > 0 ? smallio_bytes / msecs : 0);
+
+	kprintf("*** fs small I/O benchmark done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -681,7 +833,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[123456] filesystem:\n");
+		kprintf("Usage: fs[1234567] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -714,6 +866,7 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(createstress);
+DEFTEST(smallio);
 
 ////////////////////////////////////////////////////////////
 
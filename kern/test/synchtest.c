@@ -400,3 +400,148 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test and contention benchmark.
+ *
+ * NTHREADS threads each make NRWLOOPS trips through a critical
+ * section, one in RWWRITEFREQ of them as a writer. Writers update
+ * testval1 and testval2 with some busy-work in between; readers check
+ * they never see a half-done update. The same workload is run once
+ * with testlock and once with testrwlock, and the times compared.
+ */
+
+#define NRWLOOPS	200
+#define RWWRITEFREQ	16
+#define RWWORK		200
+
+static struct rwlock *testrwlock;
+static bool rwtest_usemutex;
+static volatile bool rwtest_failed;
+
+static
+void
+rwtest_enter(bool write)
+{
+	if (rwtest_usemutex) {
+		lock_acquire(testlock);
+	}
+	else if (write) {
+		rwlock_acquire_write(testrwlock);
+	}
+	else {
+		rwlock_acquire_read(testrwlock);
+	}
+}
+
+static
+void
+rwtest_leave(bool write)
+{
+	if (rwtest_usemutex) {
+		lock_release(testlock);
+	}
+	else if (write) {
+		rwlock_release_write(testrwlock);
+	}
+	else {
+		rwlock_release_read(testrwlock);
+	}
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned i;
+	volatile unsigned j;
+	unsigned long v1, v2;
+	bool write;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		write = ((i + num) % RWWRITEFREQ == 0);
+		rwtest_enter(write);
+		if (write) {
+			testval1 = num;
+			for (j=0; j<RWWORK; j++);
+			testval2 = num*num;
+		}
+		else {
+			v1 = testval1;
+			for (j=0; j<RWWORK; j++);
+			v2 = testval2;
+			if (v2 != v1*v1) {
+				kprintf("thread %lu: saw %lu and %lu\n",
+					num, v1, v2);
+				rwtest_failed = true;
+			}
+		}
+		rwtest_leave(write);
+	}
+	V(donesem);
+}
+
+static
+void
+rwtest_run(bool usemutex, struct timespec *ret)
+{
+	struct timespec before, after;
+	int i, result;
+
+	rwtest_usemutex = usemutex;
+	testval1 = testval2 = 0;
+
+	gettime(&before);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, ret);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	struct timespec mutextime, rwtime;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (testrwlock == NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	rwtest_failed = false;
+
+	kprintf("Starting rwlock test...\n");
+
+	rwtest_run(true, &mutextime);
+	rwtest_run(false, &rwtime);
+
+	kprintf("lock:   %llu.%09lu seconds\n",
+		(unsigned long long) mutextime.tv_sec,
+		(unsigned long) mutextime.tv_nsec);
+	kprintf("rwlock: %llu.%09lu seconds\n",
+		(unsigned long long) rwtime.tv_sec,
+		(unsigned long) rwtime.tv_nsec);
+
+	if (rwtest_failed) {
+		kprintf("Test failed\n");
+	}
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
@@ -257,6 +257,45 @@ waittest(int nargs, char **args)
 		printstatus(kid, err, status);
 	}
 
+	/*
+	 * This fourth set is collected with WAIT_ANY, in whatever
+	 * order the kids exit. Poll once with WNOHANG first; that
+	 * should find nothing, or at most a kid that has already
+	 * exited.
+	 */
+
+	kprintf("\n");
+	kprintf("Set 4 (wait for any child should always succeed)\n");
+	kprintf("-----------------------------------------------\n");
+
+	for (i = 0; i < NTHREADS; i++) {
+		err = dofork("wait test thread", waitfirstthread, NULL, i,
+			     &kid);
+		if (err) {
+			panic("waittest: dofork failed (%d)\n", err);
+		}
+		kprintf("Spawned pid %d\n", kid);
+	}
+
+	i = 0;
+	err = pid_wait(WAIT_ANY, &status, WNOHANG, &kid);
+	if (err) {
+		kprintf("WNOHANG waitpid error %d!\n", err);
+	}
+	else if (kid == 0) {
+		kprintf("No child exited yet\n");
+	}
+	else {
+		printstatus(kid, err, status);
+		i++;
+	}
+
+	for (; i < NTHREADS; i++) {
+		kprintf("Waiting on any child...\n");
+		err = pid_wait(WAIT_ANY, &status, 0, &kid);
+		printstatus(kid, err, status);
+	}
+
 	kprintf("\nWait test done.\n");
 
 	return 0;
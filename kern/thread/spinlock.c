@@ -43,6 +43,15 @@
  * Spinlocks.
  */
 
+/*
+ * Table of tracked spinlocks, for spinlock_printstats. Locks are
+ * never removed, so it's fixed-size and small.
+ */
+#define SPINLOCK_MAXTRACKED 32
+
+static struct spinlock *spinlock_tracked[SPINLOCK_MAXTRACKED];
+static unsigned spinlock_ntracked;
+static struct spinlock spinlock_trackedlock = SPINLOCK_INITIALIZER;
 
 /*
  * Initialize spinlock.
@@ -51,8 +60,21 @@ void
 spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_serving, 0);
+	splk->splk_ticket = false;
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
+	bzero(&splk->splk_stats, sizeof(splk->splk_stats));
+}
+
+/*
+ * Initialize spinlock as a ticket lock.
+ */
+void
+spinlock_init_ticket(struct spinlock *splk)
+{
+	spinlock_init(splk);
+	splk->splk_ticket = true;
 }
 
 /*
@@ -62,7 +84,13 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	if (splk->splk_ticket) {
+		KASSERT(spinlock_data_get(&splk->splk_lock) ==
+			spinlock_data_get(&splk->splk_serving));
+	}
+	else {
+		KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	}
 }
 
 /*
@@ -76,6 +104,8 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	unsigned spins;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,7 +123,18 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
+	spins = 0;
+	if (splk->splk_ticket) {
+		/*
+		 * Take a ticket and wait for it to come up. Only the
+		 * holder writes splk_serving, so this is just a read.
+		 */
+		ticket = spinlock_data_fetchadd(&splk->splk_lock, 1);
+		while (spinlock_data_get(&splk->splk_serving) != ticket) {
+			spins++;
+		}
+	}
+	else while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
 		 * doing test-and-set, to reduce bus contention.
@@ -105,9 +146,11 @@ spinlock_acquire(struct spinlock *splk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&splk->splk_lock) != 0) {
+			spins++;
 			continue;
 		}
 		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+			spins++;
 			continue;
 		}
 		break;
@@ -116,6 +159,13 @@ spinlock_acquire(struct spinlock *splk)
 	membar_store_any();
 	splk->splk_holder = mycpu;
 
+	/* We hold the lock, so we can update the counters. */
+	splk->splk_stats.ss_acquires++;
+	if (spins > 0) {
+		splk->splk_stats.ss_contended++;
+		splk->splk_stats.ss_spins += spins;
+	}
+
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
@@ -137,7 +187,14 @@ spinlock_release(struct spinlock *splk)
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	if (splk->splk_ticket) {
+		/* Pass the lock to the next ticket. */
+		spinlock_data_set(&splk->splk_serving,
+				  spinlock_data_get(&splk->splk_serving) + 1);
+	}
+	else {
+		spinlock_data_set(&splk->splk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -154,3 +211,45 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Add a spinlock to the table printed by spinlock_printstats.
+ */
+void
+spinlock_track(struct spinlock *splk, const char *name)
+{
+	spinlock_acquire(&spinlock_trackedlock);
+	splk->splk_stats.ss_name = name;
+	if (spinlock_ntracked < SPINLOCK_MAXTRACKED) {
+		spinlock_tracked[spinlock_ntracked++] = splk;
+	}
+	spinlock_release(&spinlock_trackedlock);
+}
+
+/*
+ * Print the counters of all tracked spinlocks. The counters are read
+ * without holding the locks they belong to, so they may be slightly
+ * out of date.
+ */
+void
+spinlock_printstats(void)
+{
+	struct spinlock_stats *ss;
+	struct spinlock *splk;
+	unsigned i, num;
+
+	spinlock_acquire(&spinlock_trackedlock);
+	num = spinlock_ntracked;
+	spinlock_release(&spinlock_trackedlock);
+
+	kprintf("%-20s %-6s %10s %10s %14s\n",
+		"spinlock", "type", "acquires", "contended", "spins");
+	for (i=0; i<num; i++) {
+		splk = spinlock_tracked[i];
+		ss = &splk->splk_stats;
+		kprintf("%-20s %-6s %10u %10u %14llu\n",
+			ss->ss_name, splk->splk_ticket ? "ticket" : "tas",
+			ss->ss_acquires, ss->ss_contended,
+			(unsigned long long)ss->ss_spins);
+	}
+}
@@ -35,10 +35,34 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
+#if OPT_LOCKSTAT
+#include <clock.h>
+#endif
+
+/*
+ * Lock profiling hooks. Like the HANGMAN_* hooks these compile to
+ * nothing unless the option is on; see the lockstat section at the
+ * bottom of the file.
+ */
+#if OPT_LOCKSTAT
+static struct lockstat *lockstat_get(const char *name);
+static void lockstat_waitstart(struct timespec *ts);
+static void lockstat_acquired(struct lock *lk, const struct timespec *ts);
+static void lockstat_released(struct lock *lk);
+#define LOCKSTAT_WAITSTART(ts)		lockstat_waitstart(ts)
+#define LOCKSTAT_ACQUIRED(lk, ts)	lockstat_acquired(lk, ts)
+#define LOCKSTAT_RELEASED(lk)		lockstat_released(lk)
+#else
+#define LOCKSTAT_WAITSTART(ts)
+#define LOCKSTAT_ACQUIRED(lk, ts)
+#define LOCKSTAT_RELEASED(lk)
+#endif
 
 ////////////////////////////////////////////////////////////
 //
@@ -163,7 +187,14 @@ lock_create(const char *name)
 		return NULL;
 	}
 	spinlock_init(&lock->lk_lock);
+	spinlock_data_set(&lock->lk_busy, 0);
+	lock->lk_nwaiting = 0;
 	lock->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	/* If this fails the lock just goes unprofiled. */
+	lock->lk_stat = lockstat_get(lock->lk_name);
+	lock->lk_holdstart.tv_sec = 0;
+#endif
 
 	return lock;
 }
@@ -174,6 +205,8 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	KASSERT(spinlock_data_get(&lock->lk_busy) == 0);
+	KASSERT(lock->lk_nwaiting == 0);
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -181,59 +214,163 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * Try to claim the lock word. Returns true if we now own the lock.
+ * As in spinlock_acquire, read first to avoid hammering the bus.
+ */
+static
+bool
+lock_tryclaim(struct lock *lock)
+{
+	if (spinlock_data_get(&lock->lk_busy) != 0) {
+		return false;
+	}
+	if (spinlock_data_testandset(&lock->lk_busy) != 0) {
+		return false;
+	}
+	membar_store_any();
+	return true;
+}
+
+/*
+ * Check (without locking) if a lock holder is running on some other
+ * cpu. This is only a hint; see lock_spin.
+ */
+static
+bool
+synch_holder_running(struct thread *holder)
+{
+	return (holder->t_state == S_RUN && holder->t_cpu != curcpu->c_self);
+}
+
+/*
+ * Adaptive spinning. If the holder is running on another cpu it will
+ * probably let go soon, and spinning for a bit is much cheaper than
+ * sleeping and paying for two context switches. Give up as soon as
+ * the holder is seen not running (it's asleep or waiting for a cpu,
+ * so we could spin for a long time) or after LOCK_SPIN_MAX tries.
+ *
+ * The holder's fields are read without any locks; they're only a
+ * hint, and the worst a stale read can do is cost us the spin budget.
+ *
+ * Returns true if we got the lock.
+ */
+#define LOCK_SPIN_MAX	1000
+
+static
+bool
+lock_spin(struct lock *lock)
+{
+	struct thread *holder;
+	unsigned i;
+
+	for (i=0; i<LOCK_SPIN_MAX; i++) {
+		if (lock_tryclaim(lock)) {
+			return true;
+		}
+		holder = lock->lk_holder;
+		if (holder == NULL) {
+			/* just released, or just claimed and not yet set */
+			continue;
+		}
+		if (!synch_holder_running(holder)) {
+			return false;
+		}
+	}
+	return false;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+#if OPT_LOCKSTAT
+	struct timespec waitstart;
+#endif
+	bool waited;
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(lock->lk_holder != curthread);
 
-	spinlock_acquire(&lock->lk_lock);
+#if !OPT_HANGMAN
+	/*
+	 * Uncontended fast path. With the deadlock detector compiled
+	 * in we always go the long way round so it sees every wait.
+	 */
+	if (spinlock_data_testandset(&lock->lk_busy) == 0) {
+		membar_store_any();
+		lock->lk_holder = curthread;
+		LOCKSTAT_ACQUIRED(lock, NULL);
+		return;
+	}
+#endif
 
-	/* Call this (atomically) before waiting for a lock */
+	/* Call this before waiting for a lock */
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
-	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
-		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+	waited = !lock_tryclaim(lock);
+	if (waited) {
+		LOCKSTAT_WAITSTART(&waitstart);
+	}
+	if (waited && !lock_spin(lock)) {
+		/*
+		 * Sleep. lk_nwaiting must be raised before the final
+		 * check of lk_busy, and lock_release clears lk_busy
+		 * before looking at lk_nwaiting; so either the releaser
+		 * sees us and wakes us, or we see the lock free.
+		 */
+		spinlock_acquire(&lock->lk_lock);
+		lock->lk_nwaiting++;
+		membar_any_any();
+		while (!lock_tryclaim(lock)) {
+			/* As in the semaphore. */
+			wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+		}
+		lock->lk_nwaiting--;
+		spinlock_release(&lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
 
-	/* Call this (atomically) once the lock is acquired */
+	/* Call this once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
 
-	spinlock_release(&lock->lk_lock);
+	LOCKSTAT_ACQUIRED(lock, waited ? &waitstart : NULL);
 }
 
 void
 lock_release(struct lock *lock)
 {
 	DEBUGASSERT(lock != NULL);
-
-	spinlock_acquire(&lock->lk_lock);
-
 	KASSERT(lock->lk_holder == curthread);
-	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 
-	/* Call this (atomically) when the lock is released */
+	LOCKSTAT_RELEASED(lock);
+
+	/* Call this when the lock is released, before anyone can grab it */
 	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
 
-	spinlock_release(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	membar_any_store();
+	spinlock_data_set(&lock->lk_busy, 0);
+
+	/* See lock_acquire. */
+	membar_any_any();
+	if (lock->lk_nwaiting > 0) {
+		spinlock_acquire(&lock->lk_lock);
+		wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+		spinlock_release(&lock->lk_lock);
+	}
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-	bool ret;
-
 	DEBUGASSERT(lock != NULL);
 
-	spinlock_acquire(&lock->lk_lock);
-	ret = (lock->lk_holder == curthread);
-	spinlock_release(&lock->lk_lock);
-
-	return ret;
+	/*
+	 * No locking needed: only the current thread can make this
+	 * true or (once true) false.
+	 */
+	return (lock->lk_holder == curthread);
 }
 
 ////////////////////////////////////////////////////////////
@@ -315,3 +452,405 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock
+
+/*
+ * Number of times a reader will check on a running writer before
+ * going to sleep. Set to 0 to disable reader spinning.
+ */
+#define RWLOCK_READSPIN	500
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rw_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_wwchan = wchan_create(rw->rw_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_wwaiting = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_wwaiting == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * Spin (for a while) as long as a writer holds the lock and is
+ * running elsewhere. As with lock_spin, this only saves sleeping when
+ * the writer is about to finish; the real check happens afterwards
+ * under rw_lock.
+ */
+static
+void
+rwlock_readspin(struct rwlock *rw)
+{
+	struct thread *writer;
+	unsigned i;
+
+	for (i=0; i<RWLOCK_READSPIN; i++) {
+		writer = rw->rw_writer;
+		if (writer == NULL || !synch_holder_running(writer)) {
+			return;
+		}
+	}
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	rwlock_readspin(rw);
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL || rw->rw_wwaiting > 0) {
+		wchan_sleep(rw->rw_rwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_wwaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_wwaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_wwchan, &rw->rw_lock);
+	}
+	rw->rw_wwaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	if (rw->rw_wwaiting > 0) {
+		/* Writers go first; readers wait until they're done. */
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	/* As in lock_do_i_hold, no locking needed. */
+	return (rw->rw_writer == curthread);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lock profiling
+
+#if OPT_LOCKSTAT
+
+/*
+ * Profile entry, one per distinct lock name. Entries live in a small
+ * chained hash table and are never freed, so lock_create can hang on
+ * to a pointer. All counters are protected by lockstat_lock. Times
+ * are in nanoseconds.
+ */
+struct lockstat {
+	struct lockstat *ls_next;	/* Hash chain */
+	char *ls_name;			/* Lock name */
+	unsigned ls_acquires;		/* Times acquired */
+	unsigned ls_waits;		/* Times acquired after waiting */
+	uint64_t ls_waittime;		/* Total time spent waiting */
+	uint64_t ls_maxwait;		/* Longest wait */
+	uint64_t ls_holdtime;		/* Total time held */
+	uint64_t ls_maxhold;		/* Longest hold */
+};
+
+#define LOCKSTAT_HASHSIZE 61
+
+static struct lockstat *lockstat_table[LOCKSTAT_HASHSIZE];
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+static volatile bool lockstat_on;
+
+static
+unsigned
+lockstat_hash(const char *name)
+{
+	unsigned h = 0;
+
+	while (*name) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h % LOCKSTAT_HASHSIZE;
+}
+
+/*
+ * Find or create the entry for NAME. Returns NULL if out of memory.
+ */
+static
+struct lockstat *
+lockstat_get(const char *name)
+{
+	struct lockstat *ls, *newls;
+	unsigned h;
+
+	h = lockstat_hash(name);
+
+	/* Allocate first, as we can't call kmalloc holding the spinlock. */
+	newls = kmalloc(sizeof(*newls));
+	if (newls == NULL) {
+		return NULL;
+	}
+	newls->ls_name = kstrdup(name);
+	if (newls->ls_name == NULL) {
+		kfree(newls);
+		return NULL;
+	}
+	newls->ls_acquires = newls->ls_waits = 0;
+	newls->ls_waittime = newls->ls_maxwait = 0;
+	newls->ls_holdtime = newls->ls_maxhold = 0;
+
+	spinlock_acquire(&lockstat_lock);
+	for (ls = lockstat_table[h]; ls != NULL; ls = ls->ls_next) {
+		if (!strcmp(ls->ls_name, name)) {
+			break;
+		}
+	}
+	if (ls == NULL) {
+		ls = newls;
+		ls->ls_next = lockstat_table[h];
+		lockstat_table[h] = ls;
+		newls = NULL;
+	}
+	spinlock_release(&lockstat_lock);
+
+	if (newls != NULL) {
+		kfree(newls->ls_name);
+		kfree(newls);
+	}
+	return ls;
+}
+
+/*
+ * Nanoseconds from START until now; also hands back now. A START of
+ * zero means the start wasn't timed.
+ */
+static
+uint64_t
+lockstat_elapsed(const struct timespec *start, struct timespec *now)
+{
+	struct timespec diff;
+
+	gettime(now);
+	if (start->tv_sec == 0) {
+		return 0;
+	}
+	timespec_sub(now, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+}
+
+static
+void
+lockstat_waitstart(struct timespec *ts)
+{
+	if (lockstat_on) {
+		gettime(ts);
+	}
+	else {
+		ts->tv_sec = 0;
+	}
+}
+
+/*
+ * Called by the new holder. WAITSTART is NULL if the lock was
+ * acquired without waiting.
+ */
+static
+void
+lockstat_acquired(struct lock *lock, const struct timespec *waitstart)
+{
+	struct lockstat *ls = lock->lk_stat;
+	uint64_t wait;
+
+	if (!lockstat_on || ls == NULL) {
+		lock->lk_holdstart.tv_sec = 0;
+		return;
+	}
+
+	if (waitstart != NULL) {
+		wait = lockstat_elapsed(waitstart, &lock->lk_holdstart);
+	}
+	else {
+		wait = 0;
+		gettime(&lock->lk_holdstart);
+	}
+
+	spinlock_acquire(&lockstat_lock);
+	ls->ls_acquires++;
+	if (waitstart != NULL) {
+		ls->ls_waits++;
+		ls->ls_waittime += wait;
+		if (wait > ls->ls_maxwait) {
+			ls->ls_maxwait = wait;
+		}
+	}
+	spinlock_release(&lockstat_lock);
+}
+
+/*
+ * Called by the holder just before letting go.
+ */
+static
+void
+lockstat_released(struct lock *lock)
+{
+	struct lockstat *ls = lock->lk_stat;
+	struct timespec now;
+	uint64_t hold;
+
+	if (ls == NULL || lock->lk_holdstart.tv_sec == 0) {
+		return;
+	}
+	hold = lockstat_elapsed(&lock->lk_holdstart, &now);
+	lock->lk_holdstart.tv_sec = 0;
+
+	spinlock_acquire(&lockstat_lock);
+	ls->ls_holdtime += hold;
+	if (hold > ls->ls_maxhold) {
+		ls->ls_maxhold = hold;
+	}
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_enable(bool on)
+{
+	lockstat_on = on;
+}
+
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+
+	spinlock_acquire(&lockstat_lock);
+	for (i=0; i<LOCKSTAT_HASHSIZE; i++) {
+		for (ls = lockstat_table[i]; ls != NULL; ls = ls->ls_next) {
+			ls->ls_acquires = ls->ls_waits = 0;
+			ls->ls_waittime = ls->ls_maxwait = 0;
+			ls->ls_holdtime = ls->ls_maxhold = 0;
+		}
+	}
+	spinlock_release(&lockstat_lock);
+}
+
+/*
+ * Print the counters. Times are printed in microseconds. We can't
+ * call kprintf holding a spinlock (it may sleep on the console lock),
+ * so copy each entry out first; entries are never freed, so walking
+ * the chains is safe.
+ */
+void
+lockstat_printstats(void)
+{
+	struct lockstat *ls, copy;
+	unsigned i;
+
+	kprintf("lockstat is %s\n", lockstat_on ? "on" : "off");
+	kprintf("%-20s %8s %8s %10s %10s %10s %10s\n", "lock",
+		"acquires", "waits", "wait us", "max wait", "hold us",
+		"max hold");
+	for (i=0; i<LOCKSTAT_HASHSIZE; i++) {
+		for (ls = lockstat_table[i]; ls != NULL; ls = ls->ls_next) {
+			spinlock_acquire(&lockstat_lock);
+			copy = *ls;
+			spinlock_release(&lockstat_lock);
+
+			if (copy.ls_acquires == 0) {
+				continue;
+			}
+			kprintf("%-20s %8u %8u %10llu %10llu %10llu %10llu\n",
+				copy.ls_name, copy.ls_acquires, copy.ls_waits,
+				(unsigned long long)(copy.ls_waittime / 1000),
+				(unsigned long long)(copy.ls_maxwait / 1000),
+				(unsigned long long)(copy.ls_holdtime / 1000),
+				(unsigned long long)(copy.ls_maxhold / 1000));
+		}
+	}
+}
+
+#endif /* OPT_LOCKSTAT */
@@ -35,6 +35,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
@@ -58,6 +60,24 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Multilevel feedback queue parameters. Level 0 is the highest
+ * priority. A thread that uses up its whole quantum drops a level; a
+ * thread that goes to sleep before then rises a level; and a thread
+ * that sits on a run queue for MLFQ_AGE_PASSES calls to schedule()
+ * also rises a level, so nothing starves.
+ */
+#define MLFQ_LEVELS		4
+#define MLFQ_QUANTUM(level)	(1U << (level))	/* in hardclocks */
+#define MLFQ_AGE_PASSES		8
+
+/*
+ * Nice values shift a thread's run queue position by one level per
+ * MLFQ_NICE_PER_LEVEL, and scale its quantum from 1.5x (at PRIO_MIN)
+ * down to 0.5x (at PRIO_MAX).
+ */
+#define MLFQ_NICE_PER_LEVEL	10
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -111,6 +131,39 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Set up the fields of a new or recycled thread, other than its name
+ * and stack.
+ */
+static
+void
+thread_initfields(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+
+	/* Scheduler fields; new threads start at the top level */
+	thread->t_mlfq_level = 0;
+	thread->t_mlfq_used = 0;
+	thread->t_mlfq_waited = 0;
+	thread->t_nice = 0;
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -133,25 +186,86 @@ thread_create(const char *name)
 		kfree(thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
-	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+	thread_initfields(thread);
 
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+	return thread;
+}
 
-	/* If you add to struct thread, be sure to initialize here */
+/*
+ * Thread recycling.
+ *
+ * Rather than freeing every exited thread, exorcise() parks up to
+ * THREAD_CACHE_MAX of them, stack and all, on the per-cpu
+ * c_threadcache list, and thread_fork takes from there before going
+ * to kmalloc. This saves two allocations (one of them a whole page
+ * for the stack) on each side of every fork/exit pair.
+ *
+ * The stack guard is checked when a thread is parked, so an overflow
+ * in the dead thread is still caught, and rewritten when the thread
+ * is reused. The name buffer is kept if the new name matches, which
+ * it usually does for forked user processes.
+ *
+ * The cache is accessed only by its own cpu, with interrupts off so
+ * a context switch can't run exorcise() in the middle of an update.
+ */
+#define THREAD_CACHE_MAX 16
 
+/*
+ * Park a zombie on this cpu's cache. Returns false if the cache is
+ * full or the thread can't be reused, in which case the caller should
+ * destroy it.
+ */
+static
+bool
+thread_cache_put(struct thread *thread)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_threadcache.tl_count >= THREAD_CACHE_MAX) {
+		return false;
+	}
+	thread_checkstack(thread);
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread->t_wchan_name = "CACHED";
+	threadlist_addhead(&curcpu->c_threadcache, thread);
+	return true;
+}
+
+/*
+ * Get a thread with a stack from this cpu's cache, renamed to NAME.
+ * Returns NULL if the cache is empty (or on allocation failure).
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	char *newname;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (strcmp(thread->t_name, name) != 0) {
+		newname = kstrdup(name);
+		if (newname == NULL) {
+			spl = splhigh();
+			threadlist_addhead(&curcpu->c_threadcache, thread);
+			splx(spl);
+			return NULL;
+		}
+		kfree(thread->t_name);
+		thread->t_name = newname;
+	}
+	thread_initfields(thread);
+	thread_checkstack_init(thread);
 	return thread;
 }
 
@@ -180,12 +294,15 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	spinlock_init_ticket(&c->c_runqueue_lock);
+	spinlock_track(&c->c_runqueue_lock, "runqueue");
+	c->c_nready = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -305,7 +422,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_cache_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -334,6 +453,7 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
 	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	curcpu->c_nready = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -445,6 +565,159 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Scheduling priority of a thread: its feedback queue level, shifted
+ * by its nice value. Lower values run first.
+ */
+static
+int
+thread_sched_rank(const struct thread *t)
+{
+	return (int)t->t_mlfq_level + t->t_nice / MLFQ_NICE_PER_LEVEL;
+}
+
+/*
+ * Length of a thread's time slice, in hardclocks.
+ */
+static
+unsigned
+thread_quantum(const struct thread *t)
+{
+	unsigned q;
+
+	q = MLFQ_QUANTUM(t->t_mlfq_level);
+	return DIVROUNDUP(q * (unsigned)(2*PRIO_MAX - t->t_nice),
+			  2*PRIO_MAX);
+}
+
+/*
+ * A thread that has used up its whole quantum is CPU-bound; move it
+ * down a level (and give it the longer quantum that goes with the
+ * lower level). Called with the thread's runqueue lock held.
+ */
+static
+void
+thread_quantum_check(struct thread *t)
+{
+	if (t->t_mlfq_used >= thread_quantum(t)) {
+		if (t->t_mlfq_level < MLFQ_LEVELS - 1) {
+			t->t_mlfq_level++;
+		}
+		t->t_mlfq_used = 0;
+	}
+}
+
+/*
+ * Put a thread on a cpu's run queue. The run queue is kept sorted by
+ * thread_sched_rank, FIFO within each rank, so the head is always
+ * the next thread to run. Scanning from the tail makes the common
+ * case (appending at the lowest rank present) cheap.
+ */
+static
+void
+thread_runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct thread *prev;
+	int rank;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	rank = thread_sched_rank(t);
+	THREADLIST_FORALL_REV(prev, c->c_runqueue) {
+		if (thread_sched_rank(prev) <= rank) {
+			threadlist_insertafter(&c->c_runqueue, prev, t);
+			c->c_nready = c->c_runqueue.tl_count;
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+	c->c_nready = c->c_runqueue.tl_count;
+}
+
+/*
+ * Take a thread off a cpu's run queue, keeping c_nready up to date.
+ * remhead returns the next thread to run, or NULL if there isn't one.
+ */
+static
+struct thread *
+thread_runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t = threadlist_remhead(&c->c_runqueue);
+	c->c_nready = c->c_runqueue.tl_count;
+	return t;
+}
+
+static
+void
+thread_runqueue_remove(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	threadlist_remove(&c->c_runqueue, t);
+	c->c_nready = c->c_runqueue.tl_count;
+}
+
+/*
+ * Take the thread at the tail of a cpu's run queue (the one at the
+ * lowest level that was queued most recently) for moving to another
+ * cpu. Returns NULL if there is nothing movable.
+ *
+ * Ordinarily a cpu's curthread will not appear on its run queue.
+ * However, it can under the following circumstances:
+ *   - it went to sleep;
+ *   - the processor became idle, so it remained curthread;
+ *   - it was reawakened, so it was put on the run queue;
+ *   - and the processor hasn't fully unidled yet, so all these
+ *     things are still true.
+ * *Migrating* that thread can cause bad things to happen (Exercise:
+ * Why? And what?) so skip over it.
+ */
+static
+struct thread *
+thread_runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	THREADLIST_FORALL_REV(t, c->c_runqueue) {
+		if (t != c->c_curthread) {
+			thread_runqueue_remove(c, t);
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * A thread was just queued on BUSY, which is running something else.
+ * If some other cpu is idle, poke it so it comes and steals the
+ * thread (see thread_steal) instead of leaving it to wait. The
+ * c_isidle reads are unlocked, so this may poke a cpu that has just
+ * become busy or miss one that has just gone idle; either way the
+ * cost is at most one spurious IPI or one tick of latency.
+ */
+static
+void
+thread_unidle_one(struct cpu *busy)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -469,7 +742,8 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_mlfq_waited = 0;
+	thread_runqueue_insert(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -478,6 +752,10 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (!targetcpu->c_isidle) {
+		/* Target is busy; let an idle cpu take the thread. */
+		thread_unidle_one(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -503,18 +781,22 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack if we have one handy */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -527,6 +809,11 @@ thread_fork(const char *name,
 	if (proc == NULL) {
 		proc = curthread->t_proc;
 	}
+
+	/* Run at the process's nice value */
+	spinlock_acquire(&proc->p_lock);
+	newthread->t_nice = proc->p_nice;
+	spinlock_release(&proc->p_lock);
 	result = proc_addthread(proc, newthread);
 	if (result) {
 		/* thread_destroy will clean up the stack */
@@ -550,6 +837,62 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Work stealing.
+ *
+ * Called by a cpu that has run out of threads, with interrupts off
+ * and no spinlocks held, before it goes to sleep in cpu_idle(). Pick
+ * the busy cpu with the most ready threads according to the unlocked
+ * c_nready hints, take one thread off the tail of its run queue, and
+ * put it on ours. Only the victim's runqueue lock is taken, and never
+ * together with our own, so two cpus stealing from each other cannot
+ * deadlock.
+ *
+ * Returns true if we got a thread.
+ */
+static
+bool
+thread_steal(void)
+{
+	unsigned i, numcpus, best;
+	struct cpu *c, *victim;
+	struct thread *t;
+
+	victim = NULL;
+	best = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		if (c->c_nready > best) {
+			best = c->c_nready;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = thread_runqueue_remtail(victim);
+	spinlock_release(&victim->c_runqueue_lock);
+	if (t == NULL) {
+		/* Lost a race with the victim or another thief. */
+		return false;
+	}
+
+	t->t_cpu = curcpu->c_self;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_runqueue_insert(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -565,6 +908,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	bool idled;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -590,6 +934,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
+	if (newstate == S_READY) {
+		thread_quantum_check(cur);
+	}
+
 	/* Micro-optimization: if nothing to do, just return */
 	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
@@ -605,6 +953,16 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		/*
+		 * Giving up the cpu to wait for something before the
+		 * quantum runs out is what interactive and I/O-bound
+		 * threads do; move it up a level.
+		 */
+		if (cur->t_mlfq_level > 0) {
+			cur->t_mlfq_level--;
+		}
+		cur->t_mlfq_used = 0;
+
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -639,19 +997,36 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before actually idling, try to steal a thread from a busy
+	 * cpu. If that works, go around again and pick it up from our
+	 * own run queue.
+	 *
+	 * While idle, turn off the periodic hardclock; there is
+	 * nothing for it to do, and anything that gives us work
+	 * either interrupts us directly or sends IPI_UNIDLE. Turn it
+	 * back on once we have a thread to run.
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	idled = false;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = thread_runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				mainbus_hardclock_stop();
+				idled = true;
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (idled) {
+		mainbus_hardclock_start();
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -821,17 +1196,88 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called periodically from hardclock(). It ages the current
+ * CPU's run queue: every thread that has been waiting for
+ * MLFQ_AGE_PASSES calls is moved up a level, so CPU-bound threads
+ * that have sunk to the bottom still get to run under load.
  */
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist promoted;
+	struct thread *t, *next;
+
+	threadlist_init(&promoted);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	t = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	while (t != NULL) {
+		next = t->t_listnode.tln_next->tln_self;
+		if (t->t_mlfq_level > 0 &&
+		    ++t->t_mlfq_waited >= MLFQ_AGE_PASSES) {
+			thread_runqueue_remove(curcpu->c_self, t);
+			t->t_mlfq_level--;
+			t->t_mlfq_used = 0;
+			t->t_mlfq_waited = 0;
+			threadlist_addtail(&promoted, t);
+		}
+		t = next;
+	}
+
+	while ((t = threadlist_remhead(&promoted)) != NULL) {
+		thread_runqueue_insert(curcpu->c_self, t);
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&promoted);
+}
+
+/*
+ * Time slicing.
+ *
+ * This is called on every hardclock(). Charge the tick to the current
+ * thread, and yield if it has used up its quantum or if a thread of
+ * higher priority is waiting. Otherwise keep running; switching to
+ * another thread at the same level before the quantum is up would
+ * only cost us a context switch.
+ *
+ * If nothing else is runnable, don't yield at all, even at the end of
+ * the quantum; just do the quantum bookkeeping in place.
+ */
+void
+thread_tick(void)
+{
+	struct thread *next;
+	bool preempt;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	/* Nothing to charge if we interrupted the idle loop. */
+	if (curcpu->c_isidle) {
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	curthread->t_mlfq_used++;
+
+	next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	if (next == NULL) {
+		thread_quantum_check(curthread);
+		preempt = false;
+	}
+	else {
+		preempt = curthread->t_mlfq_used >= thread_quantum(curthread)
+			|| thread_sched_rank(next) < thread_sched_rank(curthread);
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 
 /*
@@ -850,6 +1296,11 @@ schedule(void)
  * For here and now, because we know we're running on System/161 and
  * System/161 does not (yet) model such cache effects, we'll be very
  * aggressive.
+ *
+ * Idle cpus don't wait for this; they steal work as soon as they run
+ * out (see thread_steal). This pass only evens out cpus that are all
+ * busy but have unequal run queues, so it works from the unlocked
+ * c_nready hints rather than locking every run queue to count it.
  */
 void
 thread_consider_migration(void)
@@ -864,16 +1315,14 @@ thread_consider_migration(void)
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_nready;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_nready;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (my_count <= one_share) {
 		return;
 	}
 
@@ -881,10 +1330,15 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		/* May come up short if another cpu stole some meanwhile */
+		t = thread_runqueue_remtail(curcpu->c_self);
+		if (t == NULL) {
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
+	to_send = victims.tl_count;
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
 		c = cpuarray_get(&allcpus, i);
@@ -894,36 +1348,9 @@ thread_consider_migration(void)
 		spinlock_acquire(&c->c_runqueue_lock);
 		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			thread_runqueue_insert(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -947,7 +1374,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			thread_runqueue_insert(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -0,0 +1,954 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache.
+ *
+ * Buffers live in buffer_table, which grows up to buffer_max entries
+ * as blocks are first touched and is never shrunk. Attached buffers
+ * (ones that hold some device's block) are also linked into a hash
+ * table keyed on (device, block). When the table is full, buffers
+ * are recycled by a CLOCK sweep over buffer_table.
+ *
+ * buffer_lock protects all the buffer metadata and the statistics.
+ * It is never held across device I/O; instead a buffer is marked
+ * busy while I/O is in progress, and anyone who wants it waits on
+ * buffer_cv. buffer_cv is also signaled when a buffer's last handle
+ * is released, for the benefit of anyone waiting for a buffer to
+ * recycle. Filesystems call in here holding their own locks, so
+ * buffer_lock comes after any filesystem lock in the lock order.
+ *
+ * Writes are delayed: marking a buffer dirty does no I/O. Dirty
+ * buffers are written out by the syncer thread once they have been
+ * dirty for BUFFER_MAXAGE seconds, or sooner if more than half the
+ * cache is dirty; by eviction, if a dirty buffer is chosen as a
+ * victim; or on request by buffer_sync, buffer_flush and
+ * buffer_sync_device, which is what fsync, sync and unmount use.
+ *
+ * Read-ahead requests are queued for a separate reader thread, so
+ * the thread asking for them doesn't wait. A buffer being read
+ * ahead is attached and busy but has no handles; anyone who wants
+ * it before the read finishes waits for it like any other I/O.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <device.h>
+#include <mainbus.h>
+#include <buf.h>
+
+/*
+ * One cached block.
+ */
+struct buf {
+	struct buf *b_hashnext;		/* hash chain */
+	struct device *b_dev;		/* device, or NULL if not attached */
+	daddr_t b_block;		/* block number on the device */
+	size_t b_size;			/* block size */
+	unsigned b_refcount;		/* number of handles outstanding */
+	bool b_valid;			/* b_data holds the block's contents */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* device I/O in progress */
+	bool b_referenced;		/* CLOCK reference bit */
+	bool b_readahead;		/* read ahead and not yet used */
+	time_t b_dirtytime;		/* when b_dirty was last set */
+	void *b_data;			/* the data */
+};
+
+/* Number of hash chains; must be a power of 2. */
+#define BUFFER_HASHSIZE     256
+
+/* Never use fewer buffers than this... */
+#define BUFFER_MINBUFS      32
+
+/* ...or more than this fraction of physical memory. */
+#define BUFFER_RAMFRACTION  16
+
+/* The syncer runs this often (seconds)... */
+#define BUFFER_SYNCINTERVAL 1
+
+/* ...and writes out buffers that have been dirty this long. */
+#define BUFFER_MAXAGE       5
+
+/* Maximum number of read-ahead requests waiting for the reader. */
+#define BUFFER_RAQUEUE      64
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf **buffer_table;
+static unsigned buffer_num;		/* buffers allocated so far */
+static unsigned buffer_max;		/* maximum buffer_num */
+static unsigned buffer_hand;		/* CLOCK hand */
+static unsigned buffer_ndirty;		/* dirty buffers */
+
+/* Read-ahead queue (circular) */
+static struct cv *buffer_racv;
+static struct buf *buffer_raqueue[BUFFER_RAQUEUE];
+static unsigned buffer_rahead, buffer_ratail, buffer_racount;
+
+/* Statistics */
+static unsigned buffer_hits;		/* requests found valid in the cache */
+static unsigned buffer_misses;		/* requests that were not */
+static unsigned buffer_reads;		/* device reads */
+static unsigned buffer_writes;		/* device writes */
+static unsigned buffer_evictions;	/* attached buffers recycled */
+static unsigned buffer_syncerwrites;	/* writes done by the syncer */
+static unsigned buffer_readaheads;	/* read-ahead reads started */
+static unsigned buffer_rahits;		/* read-ahead buffers later used */
+
+static void buffer_syncer(void *, unsigned long);
+static void buffer_reader(void *, unsigned long);
+
+/*
+ * Set up the cache.
+ */
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	buffer_max = mainbus_ramsize() / BUFFER_RAMFRACTION / BUFFER_MAXSIZE;
+	if (buffer_max < BUFFER_MINBUFS) {
+		buffer_max = BUFFER_MINBUFS;
+	}
+
+	buffer_table = kmalloc(buffer_max * sizeof(struct buf *));
+	if (buffer_table == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buffer_num = 0;
+	buffer_hand = 0;
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Could not create lock\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: Could not create cv\n");
+	}
+	buffer_racv = cv_create("read-ahead");
+	if (buffer_racv == NULL) {
+		panic("buffer_bootstrap: Could not create cv\n");
+	}
+	buffer_rahead = buffer_ratail = buffer_racount = 0;
+
+	result = thread_fork("syncer", NULL, buffer_syncer, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("readahead", NULL, buffer_reader, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Hashing
+
+static
+unsigned
+buffer_hashfunc(struct device *dev, daddr_t block)
+{
+	uintptr_t d = (uintptr_t)dev;
+
+	/* Consecutive blocks of one device land in consecutive chains. */
+	return (block ^ (d >> 4) ^ (d >> 12)) & (BUFFER_HASHSIZE - 1);
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	for (b = buffer_hash[buffer_hashfunc(dev, block)];
+	     b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_attach(struct buf *b, struct device *dev, daddr_t block, size_t size)
+{
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_dev == NULL);
+	KASSERT(b->b_refcount == 0);
+
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_size = size;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_readahead = false;
+
+	h = buffer_hashfunc(dev, block);
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+static
+void
+buffer_detach(struct buf *b)
+{
+	struct buf **pp;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_dev != NULL);
+	KASSERT(b->b_refcount == 0);
+	KASSERT(!b->b_busy);
+
+	pp = &buffer_hash[buffer_hashfunc(b->b_dev, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+
+	if (b->b_dirty) {
+		buffer_ndirty--;
+	}
+	b->b_hashnext = NULL;
+	b->b_dev = NULL;
+	b->b_valid = false;
+	b->b_dirty = false;
+}
+
+////////////////////////////////////////////////////////////
+// Device I/O
+
+/*
+ * Read or write a buffer, retrying I/O errors. The buffer must be
+ * marked busy; buffer_lock must not be held.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_busy);
+	KASSERT(!lock_do_i_hold(buffer_lock));
+
+	DEBUG(DB_VFS, "buffer: %s %u\n",
+	      rw == UIO_READ ? "read" : "write", b->b_block);
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, b->b_size,
+		  ((off_t)b->b_block) * b->b_size, rw);
+	result = DEVOP_IO(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buffer: block %u: DEVOP_IO returned EINVAL\n",
+		      b->b_block);
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: block %u I/O error, giving up "
+				"after %d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Read a buffer in from disk. Drops buffer_lock during the I/O.
+ */
+static
+int
+buffer_readin(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(!b->b_busy);
+	KASSERT(!b->b_valid);
+
+	b->b_busy = true;
+	lock_release(buffer_lock);
+
+	result = buffer_io(b, UIO_READ);
+
+	lock_acquire(buffer_lock);
+	b->b_busy = false;
+	if (result == 0) {
+		b->b_valid = true;
+		buffer_reads++;
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+	return result;
+}
+
+/*
+ * Write a dirty buffer out to disk. Drops buffer_lock during the I/O.
+ *
+ * The buffer is marked clean before the I/O starts, so that if it
+ * gets changed again while the write is in progress it stays dirty.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(!b->b_busy);
+	KASSERT(b->b_dirty);
+
+	b->b_busy = true;
+	b->b_dirty = false;
+	buffer_ndirty--;
+	lock_release(buffer_lock);
+
+	result = buffer_io(b, UIO_WRITE);
+
+	lock_acquire(buffer_lock);
+	b->b_busy = false;
+	if (result) {
+		/* Leave it for someone else to retry. */
+		if (!b->b_dirty) {
+			b->b_dirty = true;
+			buffer_ndirty++;
+		}
+	}
+	else {
+		buffer_writes++;
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Allocation and replacement
+
+static
+struct buf *
+buffer_create(void)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUFFER_MAXSIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_hashnext = NULL;
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_size = 0;
+	b->b_refcount = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_referenced = false;
+	b->b_readahead = false;
+	b->b_dirtytime = 0;
+	return b;
+}
+
+/*
+ * Find a buffer that isn't attached to any block, growing the cache
+ * or evicting something as needed. May drop buffer_lock while
+ * writing out a dirty victim or waiting for buffers to be released,
+ * but not once it has picked the buffer it returns.
+ *
+ * If WAIT is false, never drops the lock: dirty buffers are passed
+ * over, and EAGAIN is returned if nothing is immediately available.
+ */
+static
+int
+buffer_getfree(bool wait, struct buf **ret)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+ again:
+	/* If we haven't reached the size limit, make a new buffer. */
+	if (buffer_num < buffer_max) {
+		b = buffer_create();
+		if (b != NULL) {
+			buffer_table[buffer_num++] = b;
+			*ret = b;
+			return 0;
+		}
+		if (buffer_num == 0) {
+			return ENOMEM;
+		}
+		/* Otherwise, make do with what we have. */
+	}
+
+	/*
+	 * Sweep the clock. Two full turns clears every reference bit,
+	 * so if we don't find anything by then, everything is either
+	 * held or busy.
+	 */
+	for (i=0; i<2*buffer_num; i++) {
+		b = buffer_table[buffer_hand];
+		buffer_hand = (buffer_hand + 1) % buffer_num;
+
+		if (b->b_refcount > 0 || b->b_busy) {
+			continue;
+		}
+		if (b->b_dev == NULL) {
+			*ret = b;
+			return 0;
+		}
+		if (b->b_referenced) {
+			b->b_referenced = false;
+			continue;
+		}
+		if (b->b_dirty) {
+			if (!wait) {
+				continue;
+			}
+			/*
+			 * Clean it. Someone may pick it up while we're
+			 * writing, so start over afterwards.
+			 */
+			result = buffer_writeout(b);
+			if (result) {
+				return result;
+			}
+			goto again;
+		}
+		buffer_evictions++;
+		buffer_detach(b);
+		*ret = b;
+		return 0;
+	}
+
+	if (!wait) {
+		return EAGAIN;
+	}
+
+	/* Wait for something to be released and try again. */
+	cv_wait(buffer_cv, buffer_lock);
+	goto again;
+}
+
+/*
+ * Common code for buffer_get and buffer_read: find or make the buffer
+ * for a block and take a handle on it. Waits for any I/O in progress
+ * on the buffer to finish.
+ */
+static
+int
+buffer_getinternal(struct device *dev, daddr_t block, size_t size,
+		   struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(dev != NULL);
+	KASSERT(size > 0 && size <= BUFFER_MAXSIZE);
+
+	b = buffer_find(dev, block);
+	while (b == NULL) {
+		result = buffer_getfree(true, &b);
+		if (result) {
+			return result;
+		}
+
+		/*
+		 * If buffer_getfree slept, someone else may have loaded
+		 * the block in the meantime. If so, use theirs. The
+		 * buffer we got is unattached, and so is harmlessly
+		 * left for the next caller.
+		 */
+		if (buffer_find(dev, block) != NULL) {
+			b = buffer_find(dev, block);
+			break;
+		}
+		buffer_attach(b, dev, block, size);
+	}
+
+	KASSERT(b->b_size == size);
+	b->b_refcount++;
+	b->b_referenced = true;
+
+	/* Holding a handle keeps the buffer from being recycled. */
+	while (b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+
+	if (b->b_valid) {
+		buffer_hits++;
+		if (b->b_readahead) {
+			buffer_rahits++;
+			b->b_readahead = false;
+		}
+	}
+	else {
+		buffer_misses++;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Get a buffer for a block without reading it in.
+ */
+int
+buffer_get(struct device *dev, daddr_t block, size_t size, struct buf **ret)
+{
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_getinternal(dev, block, size, ret);
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Get a buffer for a block, reading it in if necessary.
+ */
+int
+buffer_read(struct device *dev, daddr_t block, size_t size, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_getinternal(dev, block, size, &b);
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+
+	/* If someone else is reading it in, wait for them. */
+	while (!b->b_valid) {
+		if (b->b_busy) {
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		result = buffer_readin(b);
+		if (result) {
+			b->b_refcount--;
+			cv_broadcast(buffer_cv, buffer_lock);
+			lock_release(buffer_lock);
+			return result;
+		}
+	}
+
+	lock_release(buffer_lock);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Start reading a block into the cache without waiting for it. This
+ * is only a hint: if the block is already cached, or there's no
+ * clean buffer to put it in, or the queue is full, nothing happens.
+ */
+void
+buffer_readahead(struct device *dev, daddr_t block, size_t size)
+{
+	struct buf *b;
+
+	KASSERT(size > 0 && size <= BUFFER_MAXSIZE);
+
+	lock_acquire(buffer_lock);
+	if (buffer_racount == BUFFER_RAQUEUE ||
+	    buffer_find(dev, block) != NULL ||
+	    buffer_getfree(false, &b) != 0) {
+		lock_release(buffer_lock);
+		return;
+	}
+	buffer_attach(b, dev, block, size);
+
+	/* Busy until the reader is done; give it a chance to get used. */
+	b->b_busy = true;
+	b->b_referenced = true;
+	b->b_readahead = true;
+
+	buffer_raqueue[buffer_ratail] = b;
+	buffer_ratail = (buffer_ratail + 1) % BUFFER_RAQUEUE;
+	buffer_racount++;
+	buffer_readaheads++;
+	cv_signal(buffer_racv, buffer_lock);
+
+	lock_release(buffer_lock);
+}
+
+/*
+ * Give back a handle.
+ */
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Get the data pointer of a buffer.
+ */
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_data;
+}
+
+/*
+ * Check if a buffer holds valid data.
+ */
+bool
+buffer_is_valid(struct buf *b)
+{
+	bool ret;
+
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_refcount > 0);
+	ret = b->b_valid;
+	lock_release(buffer_lock);
+	return ret;
+}
+
+/*
+ * Mark a buffer dirty. Whoever does this must have filled in the
+ * whole block, so the buffer is now valid too.
+ */
+void
+buffer_mark_dirty(struct buf *b)
+{
+	struct timespec now;
+
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_refcount > 0);
+	if (!b->b_dirty) {
+		gettime(&now);
+		b->b_dirty = true;
+		b->b_dirtytime = now.tv_sec;
+		buffer_ndirty++;
+	}
+	b->b_valid = true;
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write a buffer out now if it's dirty.
+ */
+int
+buffer_sync(struct buf *b)
+{
+	int result = 0;
+
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_refcount > 0);
+	while (b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b->b_dirty) {
+		result = buffer_writeout(b);
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Write a block out now if it's cached and dirty. Unlike buffer_sync
+ * this doesn't need a handle, and does nothing if the block isn't in
+ * the cache.
+ */
+int
+buffer_flush(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+	int result = 0;
+
+	lock_acquire(buffer_lock);
+	while ((b = buffer_find(dev, block)) != NULL && b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL && b->b_dirty) {
+		result = buffer_writeout(b);
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * Throw away a block's buffer, if it has one, without writing it.
+ * If someone still holds a handle on it, just invalidate it; it
+ * will be detached when it's next recycled.
+ */
+void
+buffer_drop(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	while ((b = buffer_find(dev, block)) != NULL && b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL) {
+		if (b->b_dirty) {
+			b->b_dirty = false;
+			buffer_ndirty--;
+		}
+		b->b_valid = false;
+		if (b->b_refcount == 0) {
+			buffer_detach(b);
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write out all dirty buffers belonging to a device. Returns the
+ * first error encountered, but tries everything regardless.
+ */
+int
+buffer_sync_device(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+	int result, ret = 0;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<buffer_num; i++) {
+		b = buffer_table[i];
+		while (b->b_dev == dev && b->b_busy) {
+			cv_wait(buffer_cv, buffer_lock);
+		}
+		if (b->b_dev == dev && b->b_dirty) {
+			result = buffer_writeout(b);
+			if (result && ret == 0) {
+				ret = result;
+			}
+		}
+	}
+	lock_release(buffer_lock);
+	return ret;
+}
+
+/*
+ * Discard all buffers belonging to a device.
+ */
+void
+buffer_drop_device(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<buffer_num; i++) {
+		b = buffer_table[i];
+		while (b->b_dev == dev && b->b_busy) {
+			cv_wait(buffer_cv, buffer_lock);
+		}
+		if (b->b_dev == dev) {
+			KASSERT(b->b_refcount == 0);
+			buffer_detach(b);
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Print statistics.
+ */
+void
+buffer_printstats(void)
+{
+	unsigned i, attached = 0;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<buffer_num; i++) {
+		if (buffer_table[i]->b_dev != NULL) {
+			attached++;
+		}
+	}
+	kprintf("Buffer cache: %u buffers (limit %u), %u in use, %u dirty\n",
+		buffer_num, buffer_max, attached, buffer_ndirty);
+	kprintf("    %u hits, %u misses, %u reads, %u writes, "
+		"%u evictions\n", buffer_hits, buffer_misses,
+		buffer_reads, buffer_writes, buffer_evictions);
+	kprintf("    %u writes by the syncer, %u read-aheads, %u used\n",
+		buffer_syncerwrites, buffer_readaheads, buffer_rahits);
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Syncer
+
+/*
+ * One pass of the syncer: write out every buffer that has been dirty
+ * for too long. If more than half the cache is dirty, also write out
+ * younger buffers until only a quarter is. Buffers that someone
+ * holds a handle on are skipped, since they're probably about to be
+ * changed again; they'll be caught next time.
+ *
+ * Write errors are left for fsync or sync to report; the buffer
+ * stays dirty and is retried next pass.
+ */
+static
+void
+buffer_syncer_pass(void)
+{
+	struct timespec now;
+	struct buf *b;
+	unsigned i;
+	bool pressure;
+
+	gettime(&now);
+
+	lock_acquire(buffer_lock);
+	pressure = buffer_ndirty > buffer_max / 2;
+	for (i=0; i<buffer_num; i++) {
+		b = buffer_table[i];
+		if (pressure && buffer_ndirty <= buffer_max / 4) {
+			pressure = false;
+		}
+		if (!b->b_dirty || b->b_busy || b->b_refcount > 0) {
+			continue;
+		}
+		if (!pressure && now.tv_sec - b->b_dirtytime < BUFFER_MAXAGE) {
+			continue;
+		}
+		if (buffer_writeout(b) == 0) {
+			buffer_syncerwrites++;
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * The syncer thread.
+ */
+static
+void
+buffer_syncer(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(BUFFER_SYNCINTERVAL);
+		buffer_syncer_pass();
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Read-ahead
+
+/*
+ * The reader thread: do queued read-ahead requests one at a time.
+ */
+static
+void
+buffer_reader(void *data1, unsigned long data2)
+{
+	struct buf *b;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_racount == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		b = buffer_raqueue[buffer_rahead];
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUE;
+		buffer_racount--;
+
+		KASSERT(b->b_busy);
+		KASSERT(!b->b_valid);
+		lock_release(buffer_lock);
+
+		result = buffer_io(b, UIO_READ);
+
+		lock_acquire(buffer_lock);
+		b->b_busy = false;
+		if (result == 0) {
+			b->b_valid = true;
+			buffer_reads++;
+		}
+		else {
+			/* Whoever wants it will try again and see the error */
+			b->b_readahead = false;
+		}
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+}
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name cache.
+ *
+ * There is a fixed pool of NAMECACHE_SIZE entries, allocated at boot.
+ * Entries in use are hashed on their name alone, so that
+ * namecache_remove can find every entry with a given name in one
+ * chain; lookups then compare the directory as well. All entries,
+ * used or not, are kept on an LRU list, with free ones at the old
+ * end, and a new entry always takes the oldest one.
+ *
+ * namecache_lock protects everything here. It is only taken by the
+ * VFS layer when holding no filesystem locks, so it comes before all
+ * of them in the lock order. Vnode references dropped by eviction or
+ * invalidation are released after namecache_lock, though, since that
+ * can mean reclaiming the vnode and doing I/O.
+ *
+ * namecache_gen counts invalidations. A lookup that misses notes the
+ * count; if it has changed by the time the filesystem's answer comes
+ * back, something may have changed under the lookup, and its answer
+ * is not cached.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <namecache.h>
+
+/*
+ * One cached name.
+ */
+struct ncentry {
+	struct ncentry *nc_hashnext;	/* hash chain */
+	struct ncentry *nc_lruprev;	/* LRU list, more recent */
+	struct ncentry *nc_lrunext;	/* LRU list, less recent */
+	struct vnode *nc_dir;		/* directory, or NULL if free */
+	struct vnode *nc_vn;		/* vnode found, or NULL if none */
+	char nc_name[NAMECACHE_NAMELEN+1];
+};
+
+/* Number of entries. */
+#define NAMECACHE_SIZE     512
+
+/* Number of hash chains; must be a power of 2. */
+#define NAMECACHE_HASHSIZE 256
+
+static struct lock *namecache_lock;
+static struct ncentry *namecache_hash[NAMECACHE_HASHSIZE];
+static struct ncentry *namecache_lruhead, *namecache_lrutail;
+static unsigned namecache_gen;
+
+/* Statistics */
+static unsigned namecache_hits;		/* positive entries found */
+static unsigned namecache_neghits;	/* negative entries found */
+static unsigned namecache_misses;	/* lookups not found */
+static unsigned namecache_enters;	/* entries made */
+static unsigned namecache_stale;	/* entries not made due to races */
+static unsigned namecache_evictions;	/* entries recycled */
+static unsigned namecache_removes;	/* entries invalidated */
+
+/*
+ * Set up the cache.
+ */
+void
+namecache_bootstrap(void)
+{
+	struct ncentry *pool;
+	unsigned i;
+
+	pool = kmalloc(NAMECACHE_SIZE * sizeof(struct ncentry));
+	if (pool == NULL) {
+		panic("namecache_bootstrap: Out of memory\n");
+	}
+
+	namecache_lock = lock_create("name cache");
+	if (namecache_lock == NULL) {
+		panic("namecache_bootstrap: Could not create lock\n");
+	}
+
+	for (i=0; i<NAMECACHE_HASHSIZE; i++) {
+		namecache_hash[i] = NULL;
+	}
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		pool[i].nc_hashnext = NULL;
+		pool[i].nc_lruprev = i > 0 ? &pool[i-1] : NULL;
+		pool[i].nc_lrunext = i < NAMECACHE_SIZE-1 ? &pool[i+1] : NULL;
+		pool[i].nc_dir = NULL;
+		pool[i].nc_vn = NULL;
+		pool[i].nc_name[0] = 0;
+	}
+	namecache_lruhead = &pool[0];
+	namecache_lrutail = &pool[NAMECACHE_SIZE-1];
+	namecache_gen = 0;
+}
+
+////////////////////////////////////////////////////////////
+// Internals
+
+/*
+ * Hash a name. (This is the djb2 hash.)
+ */
+static
+unsigned
+namecache_hashfunc(const char *name)
+{
+	uint32_t hash = 5381;
+
+	while (*name) {
+		hash = hash*33 + (unsigned char)*name++;
+	}
+	return hash & (NAMECACHE_HASHSIZE - 1);
+}
+
+/*
+ * Whether a name is one we cache at all.
+ */
+static
+bool
+namecache_cacheable(struct vnode *dir, const char *name)
+{
+	if (dir->vn_fs == NULL) {
+		/* device vnode */
+		return false;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		/* not worth the trouble of keeping right */
+		return false;
+	}
+	return strlen(name) <= NAMECACHE_NAMELEN;
+}
+
+static
+void
+namecache_lru_remove(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		namecache_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		namecache_lrutail = nc->nc_lruprev;
+	}
+	nc->nc_lruprev = nc->nc_lrunext = NULL;
+}
+
+static
+void
+namecache_lru_addhead(struct ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = namecache_lruhead;
+	if (namecache_lruhead != NULL) {
+		namecache_lruhead->nc_lruprev = nc;
+	}
+	else {
+		namecache_lrutail = nc;
+	}
+	namecache_lruhead = nc;
+}
+
+static
+void
+namecache_lru_addtail(struct ncentry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = namecache_lrutail;
+	if (namecache_lrutail != NULL) {
+		namecache_lrutail->nc_lrunext = nc;
+	}
+	else {
+		namecache_lruhead = nc;
+	}
+	namecache_lrutail = nc;
+}
+
+/*
+ * Take an entry out of its hash chain.
+ */
+static
+void
+namecache_unhash(struct ncentry *nc)
+{
+	struct ncentry **pp;
+
+	KASSERT(nc->nc_dir != NULL);
+
+	for (pp = &namecache_hash[namecache_hashfunc(nc->nc_name)];
+	     *pp != nc;
+	     pp = &(*pp)->nc_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+}
+
+static
+struct ncentry *
+namecache_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	KASSERT(lock_do_i_hold(namecache_lock));
+
+	for (nc = namecache_hash[namecache_hashfunc(name)];
+	     nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Drop the references held by a list of entries that have been
+ * taken out of the cache (chained through nc_hashnext), and put
+ * them back on the LRU list as free entries.
+ */
+static
+void
+namecache_release(struct ncentry *dead)
+{
+	struct ncentry *nc, *next;
+
+	KASSERT(!lock_do_i_hold(namecache_lock));
+
+	if (dead == NULL) {
+		return;
+	}
+
+	for (nc = dead; nc != NULL; nc = nc->nc_hashnext) {
+		VOP_DECREF(nc->nc_dir);
+		if (nc->nc_vn != NULL) {
+			VOP_DECREF(nc->nc_vn);
+		}
+	}
+
+	lock_acquire(namecache_lock);
+	for (nc = dead; nc != NULL; nc = next) {
+		next = nc->nc_hashnext;
+		nc->nc_hashnext = NULL;
+		nc->nc_dir = NULL;
+		nc->nc_vn = NULL;
+		namecache_lru_addtail(nc);
+	}
+	lock_release(namecache_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Look up a name.
+ */
+bool
+namecache_lookup(struct vnode *dir, const char *name,
+		 struct vnode **ret, unsigned *gen)
+{
+	struct ncentry *nc;
+
+	if (!namecache_cacheable(dir, name)) {
+		/* namecache_enter will ignore it anyway */
+		*gen = 0;
+		return false;
+	}
+
+	lock_acquire(namecache_lock);
+	nc = namecache_find(dir, name);
+	if (nc == NULL) {
+		namecache_misses++;
+		*gen = namecache_gen;
+		lock_release(namecache_lock);
+		return false;
+	}
+
+	/* Move it to the recent end */
+	namecache_lru_remove(nc);
+	namecache_lru_addhead(nc);
+
+	if (nc->nc_vn != NULL) {
+		namecache_hits++;
+		VOP_INCREF(nc->nc_vn);
+	}
+	else {
+		namecache_neghits++;
+	}
+	*ret = nc->nc_vn;
+	lock_release(namecache_lock);
+	return true;
+}
+
+/*
+ * Add an entry.
+ */
+void
+namecache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		unsigned gen)
+{
+	struct ncentry *nc;
+
+	if (!namecache_cacheable(dir, name)) {
+		return;
+	}
+
+	lock_acquire(namecache_lock);
+
+	while (1) {
+		if (gen != namecache_gen) {
+			namecache_stale++;
+			lock_release(namecache_lock);
+			return;
+		}
+		if (namecache_find(dir, name) != NULL) {
+			/* someone else got here first */
+			lock_release(namecache_lock);
+			return;
+		}
+
+		/* Take the oldest entry... */
+		nc = namecache_lrutail;
+		KASSERT(nc != NULL);
+		if (nc->nc_dir == NULL) {
+			break;
+		}
+
+		/*
+		 * ...but it's in use, so evict it first. That means
+		 * unlocking to drop its references, so look again
+		 * afterwards.
+		 */
+		namecache_unhash(nc);
+		namecache_lru_remove(nc);
+		namecache_evictions++;
+		lock_release(namecache_lock);
+		namecache_release(nc);
+		lock_acquire(namecache_lock);
+	}
+
+	namecache_lru_remove(nc);
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+	nc->nc_hashnext = namecache_hash[namecache_hashfunc(name)];
+	namecache_hash[namecache_hashfunc(name)] = nc;
+	namecache_lru_addhead(nc);
+	namecache_enters++;
+
+	lock_release(namecache_lock);
+}
+
+/*
+ * Invalidate a name.
+ */
+void
+namecache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc, *next, *dead = NULL;
+	struct fs *fs = dir->vn_fs;
+
+	if (fs == NULL) {
+		return;
+	}
+
+	lock_acquire(namecache_lock);
+	namecache_gen++;
+	if (strlen(name) <= NAMECACHE_NAMELEN) {
+		for (nc = namecache_hash[namecache_hashfunc(name)];
+		     nc != NULL;
+		     nc = next) {
+			next = nc->nc_hashnext;
+			if (nc->nc_dir->vn_fs == fs &&
+			    !strcmp(nc->nc_name, name)) {
+				namecache_unhash(nc);
+				namecache_lru_remove(nc);
+				nc->nc_hashnext = dead;
+				dead = nc;
+				namecache_removes++;
+			}
+		}
+	}
+	lock_release(namecache_lock);
+
+	namecache_release(dead);
+}
+
+/*
+ * Invalidate a whole filesystem.
+ */
+void
+namecache_purgefs(struct fs *fs)
+{
+	struct ncentry *nc, *next, *dead = NULL;
+	unsigned i;
+
+	lock_acquire(namecache_lock);
+	namecache_gen++;
+	for (i=0; i<NAMECACHE_HASHSIZE; i++) {
+		for (nc = namecache_hash[i]; nc != NULL; nc = next) {
+			next = nc->nc_hashnext;
+			if (nc->nc_dir->vn_fs == fs) {
+				namecache_unhash(nc);
+				namecache_lru_remove(nc);
+				nc->nc_hashnext = dead;
+				dead = nc;
+				namecache_removes++;
+			}
+		}
+	}
+	lock_release(namecache_lock);
+
+	namecache_release(dead);
+}
+
+/*
+ * Print statistics.
+ */
+void
+namecache_printstats(void)
+{
+	unsigned used = 0;
+	struct ncentry *nc;
+
+	lock_acquire(namecache_lock);
+	for (nc = namecache_lruhead; nc != NULL; nc = nc->nc_lrunext) {
+		if (nc->nc_dir != NULL) {
+			used++;
+		}
+	}
+	kprintf("Name cache: %u entries, %u in use\n", NAMECACHE_SIZE, used);
+	kprintf("    %u hits, %u negative hits, %u misses\n",
+		namecache_hits, namecache_neghits, namecache_misses);
+	kprintf("    %u entered, %u stale, %u evicted, %u invalidated\n",
+		namecache_enters, namecache_stale, namecache_evictions,
+		namecache_removes);
+	lock_release(namecache_lock);
+}
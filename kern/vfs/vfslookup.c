@@ -39,6 +39,7 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <namecache.h>
 
 static struct vnode *bootfs_vnode = NULL;
 
@@ -246,11 +247,14 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
+	/*
+	 * The big lock only protects the device and mount tables that
+	 * getdevice looks at; filesystems lock their own vnodes.
+	 */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -268,33 +272,81 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
+/*
+ * Look up one path component NAME in directory DIR, going through
+ * the name cache.
+ */
+static
+int
+vfs_lookupone(struct vnode *dir, char *name, struct vnode **retval)
+{
+	struct vnode *vn;
+	unsigned gen;
+	int result;
+
+	if (namecache_lookup(dir, name, &vn, &gen)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*retval = vn;
+		return 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, &vn);
+	if (result == 0) {
+		namecache_enter(dir, name, vn, gen);
+		*retval = vn;
+	}
+	else if (result == ENOENT) {
+		namecache_enter(dir, name, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * vfs_lookup walks the path one component at a time, rather than
+ * handing the whole thing to the filesystem at once, so that each
+ * step can be answered from the name cache.
+ */
 int
 vfs_lookup(char *path, struct vnode **retval)
 {
-	struct vnode *startvn;
+	struct vnode *vn, *next;
+	char *name;
 	int result;
 
 	vfs_biglock_acquire();
-
-	result = getdevice(path, &path, &startvn);
+	result = getdevice(path, &path, &vn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	if (strlen(path)==0) {
-		*retval = startvn;
-		vfs_biglock_release();
-		return 0;
-	}
+	while (*path != 0) {
+		/* Split off the next component, skipping extra slashes. */
+		name = path;
+		path = strchr(name, '/');
+		if (path == NULL) {
+			path = name + strlen(name);
+		}
+		else {
+			*path++ = 0;
+		}
+		if (*name == 0) {
+			continue;
+		}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+		result = vfs_lookupone(vn, name, &next);
+		VOP_DECREF(vn);
+		if (result) {
+			return result;
+		}
+		vn = next;
+	}
 
-	VOP_DECREF(startvn);
-	vfs_biglock_release();
-	return result;
+	*retval = vn;
+	return 0;
 }
@@ -188,6 +188,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	w = writeable ? WRITE : 0;
 	e = executable ? EXE : 0;
 	char p = r | w | e;
+
+	// enforce RLIMIT_AS
+	if((rlim_t)as->vsize + memsize > proc_getlimit(curproc, RLIMIT_AS)){
+		return ENOMEM;
+	}
+
 	int err = append_region(as, p, vaddr, memsize);
 
 	if(err){
@@ -253,6 +259,7 @@ append_region(struct addrspace *as, char permissions, vaddr_t start, size_t size
 	new->size = size;
 	new->start = start;
 	new->next = NULL;
+	as->vsize += size;
 
 	cur = as->regions;
 	prev = cur;
@@ -271,8 +278,11 @@ append_region(struct addrspace *as, char permissions, vaddr_t start, size_t size
 	 * we need to check whether new's start is less than or equal to prev + size
 	 * new's end is less than or equal to prev + size
 	*/
-	if(cur != NULL && (new->start + new->size > cur->start))
-		return EADDRINUSE;	
+	if(cur != NULL && (new->start + new->size > cur->start)){
+		as->vsize -= size;
+		kfree(new);
+		return EADDRINUSE;
+	}
 	prev->next = new;
 	new->next = cur;
 	return 0;
@@ -348,6 +358,7 @@ static int pt_dup(struct addrspace *new, struct addrspace *old)
                 memmove((void*) newframe, (const void *)PADDR_TO_KVADDR(oe[j].entrylo & PAGE_FRAME), PAGE_SIZE); 
                 ne[j].permissions = oe[j].permissions;
 				ne[j].entrylo = KVADDR_TO_PADDR(newframe) & PAGE_FRAME;
+				new->npages++;
             }
         }
         //assign return value
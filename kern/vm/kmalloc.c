@@ -166,7 +166,7 @@ struct pageref {
  * OS/161 performance and scalability aren't super-critical.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock = SPINLOCK_TICKET_INITIALIZER;
 
 ////////////////////////////////////////
 
@@ -697,6 +697,16 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+/*
+ * Call once during startup, to make the allocator's lock show up in
+ * the spinlock statistics.
+ */
+void
+kheap_bootstrap(void)
+{
+	spinlock_track(&kmalloc_spinlock, "kmalloc");
+}
+
 void
 kheap_nextgeneration(void)
 {
@@ -7,6 +7,7 @@
 #include <vm.h>
 #include <machine/tlb.h>
 #include <proc.h>
+#include <current.h>
 
 /* Place your page table functions here */
 
@@ -25,6 +26,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	int spl;
     struct addrspace *as;
 	struct entry *pe = NULL;
+	rlim_t rsslimit;
 	uint32_t entrylo, entryhi = faultaddress & TLBHI_VPAGE;
 	
 	if(faultaddress == 0x0 || faultaddress >= 0x80000000){
@@ -35,6 +37,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	if(as == NULL){
 		return ENOMEM;
 	}
+	rsslimit = proc_getlimit(curproc, RLIMIT_RSS);
 
 	spl = splhigh();
 	if(faulttype == VM_FAULT_READ || faulttype == VM_FAULT_WRITE){
@@ -45,6 +48,12 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			perms = region_perm_search(as, faultaddress);
 			if(perms == -1)
 				return EFAULT;
+
+			// enforce RLIMIT_RSS
+			if((rlim_t)(as->npages + 1) * PAGE_SIZE > rsslimit){
+				splx(spl);
+				return ENOMEM;
+			}
 			
 			// alloc new frame
 			uint32_t newframe = alloc_kpages(1);
@@ -54,6 +63,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			}
 
 			pe = pt_insert(as, KVADDR_TO_PADDR(newframe), faultaddress, perms);
+			as->npages++;
 		}
 		entrylo = pe->entrylo;
 
@@ -43,6 +43,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* after kern/time.h; uses struct timeval */
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -131,6 +132,8 @@ int rmdir(const char *dirname);
 pid_t getpid(void);
 int ioctl(int filehandle, int code, void *buf);
 off_t lseek(int filehandle, off_t pos, int code);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
 int fsync(int filehandle);
 int ftruncate(int filehandle, off_t size);
 int remove(const char *filename);
@@ -148,6 +151,12 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
+int getpriority(int which, pid_t who);
+int setpriority(int which, pid_t who, int prio);
+int getrlimit(int resource, struct rlimit *rl);
+int setrlimit(int resource, const struct rlimit *rl);
+int futex_wait(volatile int *addr, int val);
+int futex_wake(volatile int *addr, int count);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
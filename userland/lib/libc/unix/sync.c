@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sync.h>
+
+/*
+ * User-level mutexes and semaphores. See sync.h.
+ *
+ * The mutex is the classic three-state futex mutex: 0 means free, 1
+ * held with nobody waiting, and 2 held with (possibly) someone
+ * waiting. Only a transition out of state 2 needs to call into the
+ * kernel to wake anyone.
+ */
+
+/*
+ * Atomic compare-and-swap: if *p is OLD, set it to NEW. Returns the
+ * value previously in *p. This uses the MIPS LL/SC instructions; see
+ * the kernel's spinlock code for the details. Retry if the SC fails.
+ */
+static
+int
+atomic_cas(volatile int *p, int old, int new)
+{
+	int x, y;
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			".set noreorder;"	/* don't fill the branch slot */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   if (x != old) fail */
+			"li %1, 1;"		/*   (delay slot) y = 1 */
+			"move %1, %4;"		/*   y = new */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y)
+			: "r" (p), "r" (old), "r" (new)
+			: "memory");
+	} while (y == 0);
+	return x;
+}
+
+/*
+ * Atomically add DELTA to *p, returning the old value.
+ */
+static
+int
+atomic_add(volatile int *p, int delta)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (atomic_cas(p, old, old + delta) != old);
+	return old;
+}
+
+/*
+ * Atomically set *p to VAL, returning the old value.
+ */
+static
+int
+atomic_swap(volatile int *p, int val)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (atomic_cas(p, old, val) != old);
+	return old;
+}
+
+////////////////////////////////////////////////////////////
+
+void
+umutex_init(struct umutex *m)
+{
+	m->um_state = 0;
+}
+
+int
+umutex_trylock(struct umutex *m)
+{
+	return atomic_cas(&m->um_state, 0, 1) == 0;
+}
+
+void
+umutex_lock(struct umutex *m)
+{
+	int c;
+
+	/* Fast path: free -> held. */
+	c = atomic_cas(&m->um_state, 0, 1);
+	if (c == 0) {
+		return;
+	}
+
+	/*
+	 * Slow path. Mark the mutex contended and sleep until we're
+	 * the one who changes it from free. Since we can't tell if
+	 * anyone else is still waiting, we always take it in state
+	 * 2, which at worst costs one unneeded wakeup call.
+	 */
+	if (c != 2) {
+		c = atomic_swap(&m->um_state, 2);
+	}
+	while (c != 0) {
+		futex_wait(&m->um_state, 2);
+		c = atomic_swap(&m->um_state, 2);
+	}
+}
+
+void
+umutex_unlock(struct umutex *m)
+{
+	/* Fast path: held -> free with nobody waiting. */
+	if (atomic_add(&m->um_state, -1) != 1) {
+		m->um_state = 0;
+		futex_wake(&m->um_state, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+void
+usem_init(struct usem *s, unsigned count)
+{
+	s->us_count = count;
+	s->us_waiters = 0;
+}
+
+void
+usem_P(struct usem *s)
+{
+	int c;
+
+	while (1) {
+		c = s->us_count;
+		if (c > 0) {
+			if (atomic_cas(&s->us_count, c, c - 1) == c) {
+				return;
+			}
+			continue;
+		}
+
+		/*
+		 * Count is zero. Register as a waiter before sleeping;
+		 * if a V sneaks in between, the count will no longer
+		 * be C and futex_wait returns immediately.
+		 */
+		atomic_add(&s->us_waiters, 1);
+		futex_wait(&s->us_count, c);
+		atomic_add(&s->us_waiters, -1);
+	}
+}
+
+void
+usem_V(struct usem *s)
+{
+	atomic_add(&s->us_count, 1);
+	if (s->us_waiters > 0) {
+		futex_wake(&s->us_count, 1);
+	}
+}
@@ -255,6 +255,25 @@ dumpindirect(uint32_t block)
 	}
 }
 
+static
+void
+dumpdindirect(uint32_t block)
+{
+	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	unsigned i;
+
+	if (block == 0) {
+		return;
+	}
+	printf("Double indirect block %u:\n", block);
+	dumpindirect(block);
+
+	diskread(ib, block);
+	for (i=0; i<ARRAYCOUNT(ib); i++) {
+		dumpindirect(SWAP32(ib[i]));
+	}
+}
+
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
@@ -293,6 +312,20 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 		fileblock = traverse_ib(fileblock, numblocks,
 					SWAP32(sfi->sfi_indirect), doblock);
 	}
+	if (fileblock < numblocks) {
+		uint32_t dib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+
+		if (SWAP32(sfi->sfi_dindirect) == 0) {
+			memset(dib, 0, sizeof(dib));
+		}
+		else {
+			diskread(dib, SWAP32(sfi->sfi_dindirect));
+		}
+		for (i=0; i<ARRAYCOUNT(dib) && fileblock < numblocks; i++) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(dib[i]), doblock);
+		}
+	}
 	assert(fileblock == numblocks);
 }
 
@@ -476,6 +509,8 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -485,6 +520,7 @@ dumpinode(uint32_t ino, const char *name)
 
 	if (doindirect) {
 		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpdindirect(SWAP32(sfi.sfi_dindirect));
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {